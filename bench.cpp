@@ -0,0 +1,284 @@
+// Benchmarks of the question file handling.
+// Usage: ./bench [question file]
+// Without a question file, a synthetic one is generated in the temp directory.
+
+#include <chrono>
+#include <random>
+#include <cwctype>
+#include <locale>
+#include <codecvt>
+#include <numeric>
+#include <algorithm>
+#include <unordered_set>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <unistd.h>
+#include "qa-file.h"
+#include "csv-parser.h"
+#include "mapped-file.h"
+#include "thread-pool.h"
+#include "string-arena.h"
+
+namespace {
+
+using Records = std::vector<std::vector<std::string>>;
+
+// The stream-based parser ReadCSV used before CSVParser, for reference.
+std::pair<bool, std::vector<std::string>> CSVLineToVector(std::ifstream& fin) {
+  std::vector<std::string> ans;
+  std::string current;
+  int in_quote = 0;
+  char ch;
+  while (fin.get(ch)) {
+    if (in_quote == 2) {
+      if (ch == ',') {
+        ans.emplace_back(std::move(current));
+        current.clear();
+      } else if (ch == '\"') {
+        in_quote = 1;
+        current.push_back(ch);
+      } else { // error
+        in_quote = 0;
+        current.push_back(ch);
+      }
+    } else if (in_quote == 1) {
+      if (ch == '\"') {
+        in_quote = 2;
+      } else {
+        current.push_back(ch);
+      }
+    } else {
+      switch (ch) {
+        case '\"': in_quote = 1; break;
+        case ',':
+          ans.emplace_back(std::move(current));
+          current.clear();
+          break;
+        case '\r': fin.get(); [[fallthrough]]; // should be '\n'
+        case '\n': ans.emplace_back(std::move(current)); return {true, ans};
+        case (char)0xfe: case (char)0xff: break; // Invalid UTF-8; ignore because of BOM
+        default: current.push_back(ch);
+      }
+    }
+  }
+  if (current.size()) ans.emplace_back(std::move(current));
+  if (ans.size()) return {true, ans};
+  return {false, ans};
+}
+
+Records ParseLegacy(const std::string& filename) {
+  Records ret;
+  std::ifstream fin(filename);
+  for (auto line = CSVLineToVector(fin); line.first;
+       line = CSVLineToVector(fin)) {
+    ret.push_back(std::move(line.second));
+  }
+  return ret;
+}
+
+// Returns the number of records; fills `out` if given
+size_t ParseMapped(const std::string& filename, Records* out) {
+  MappedFile file;
+  file.Open(filename);
+  StringArena arena(file.size());
+  CSVParser parser(file.begin(), file.end(), arena.data());
+  std::vector<std::string_view> fields;
+  size_t num = 0;
+  while (parser.NextRecord(fields)) {
+    if (out) out->emplace_back(fields.begin(), fields.end());
+    num++;
+  }
+  return num;
+}
+
+std::string GenerateBank(size_t rows) {
+  std::mt19937_64 gen(1);
+  const std::string words[] = {"capital", "of", "the", "country", "river",
+                               "\xe5\x9c\x8b\xe5\xae\xb6", "mountain",
+                               "\xe9\xa6\x96\xe9\x83\xbd", "which", "year"};
+  auto Sentence = [&](int len) {
+    std::string ret;
+    for (int i = 0; i < len; i++) {
+      if (i) ret += ' ';
+      ret += words[gen() % 10];
+    }
+    return ret;
+  };
+  auto path = std::filesystem::temp_directory_path() / "qa-bench.csv";
+  std::ofstream fout(path, std::ios::binary);
+  fout << "\xef\xbb\xbf" "Benchmark,1, -\r\n";
+  for (size_t i = 0; i < rows; i++) {
+    switch (gen() % 8) {
+      case 0: // quoted, with comma and escaped quotes
+        fout << "\"" << Sentence(6) << ", \"\"" << Sentence(2) << "\"\"\","
+             << Sentence(2) << "\r\n";
+        break;
+      case 1: fout << Sentence(12) << "," << Sentence(1) << ",1\r\n"; break;
+      default: fout << Sentence(8) << "," << Sentence(2) << "\r\n";
+    }
+  }
+  return path;
+}
+
+// Score before the answer keys, which normalized both answers on every call
+int ScoreLegacy(const Question& q, const std::string& user_ans,
+                const std::unordered_set<wchar_t>& ignore_chars) {
+  if (user_ans.empty()) return 0;
+  std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
+  std::wstring ans = conv.from_bytes(std::string(q.answer)),
+               user = conv.from_bytes(user_ans);
+  if (q.case_sensitive) {
+    for (auto& i : ans) i = std::towupper(i);
+    for (auto& i : user) i = std::towupper(i);
+  }
+  auto FilterRule = [&ignore_chars](wchar_t i) { return !ignore_chars.count(i); };
+  ans.resize(std::stable_partition(ans.begin(), ans.end(), FilterRule) -
+             ans.begin());
+  user.resize(std::stable_partition(user.begin(), user.end(), FilterRule) -
+              user.begin());
+  return ans == user;
+}
+
+template <class Func>
+double Measure(Func&& func, int repeat = 3) {
+  double best = 1e100;
+  for (int i = 0; i < repeat; i++) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    best = std::min(best, t.count());
+  }
+  return best;
+}
+
+bool SameQuestions(const QuestionSet& a, const QuestionSet& b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    Question x = a.Get(i), y = b.Get(i);
+    if (x.id != y.id || x.description != y.description ||
+        x.answer != y.answer || x.answer_key != y.answer_key ||
+        x.case_sensitive != y.case_sensitive) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Resident set size in MB
+double ResidentMB() {
+  std::ifstream fin("/proc/self/statm");
+  size_t total = 0, resident = 0;
+  fin >> total >> resident;
+  return resident * (double)sysconf(_SC_PAGESIZE) / 1e6;
+}
+
+void Report(const std::string& name, double sec, size_t bytes) {
+  printf("%-28s %9.3f ms %9.1f MB/s\n", name.c_str(), sec * 1e3,
+         bytes / sec / 1e6);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  std::string filename = argc > 1 ? argv[1] : GenerateBank(1000000);
+  size_t bytes = std::filesystem::file_size(filename);
+  printf("%s: %zu bytes\n\n", filename.c_str(), bytes);
+
+  Records expected = ParseLegacy(filename);
+  Report("ifstream (legacy)", Measure([&] { ParseLegacy(filename); }), bytes);
+  std::pair<CSVScanner, const char*> scanners[] = {
+      {CSVScanner::kScalar, "mmap + scalar scan"},
+      {CSVScanner::kSSE2, "mmap + SSE2 scan"},
+      {CSVScanner::kAVX2, "mmap + AVX2 scan"}};
+  for (auto& i : scanners) {
+    if (!SetCSVScanner(i.first)) {
+      printf("%-28s unsupported\n", i.second);
+      continue;
+    }
+    Records result;
+    ParseMapped(filename, &result);
+    if (result != expected) {
+      printf("%s: result differs from the legacy parser!\n", i.second);
+      return 1;
+    }
+    Report(i.second, Measure([&] { ParseMapped(filename, nullptr); }), bytes);
+  }
+  SetCSVScanner(CSVScanner::kAuto);
+
+  printf("\nOpen modes (time, growth of resident memory)\n");
+  std::pair<QuestionSet (*)(const std::string&, ThreadPool*), const char*>
+      modes[] = {{IndexCSV, "IndexCSV (lazy)"}, {ReadCSV, "ReadCSV"}};
+  for (auto& i : modes) {
+    double before = ResidentMB();
+    auto start = std::chrono::steady_clock::now();
+    QuestionSet qs = i.first(filename, nullptr);
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    printf("%-28s %9.3f ms %9.1f MB\n", i.second, t.count() * 1e3,
+           ResidentMB() - before);
+  }
+
+  printf("\nReadCSV scaling (%u cores)\n",
+         std::thread::hardware_concurrency());
+  QuestionSet sequential;
+  {
+    ThreadPool pool(1);
+    sequential = ReadCSV(filename, &pool);
+  }
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t threads = 1;; threads = std::min(threads * 2, max_threads)) {
+    ThreadPool pool(threads);
+    if (!SameQuestions(sequential, ReadCSV(filename, &pool))) {
+      printf("%zu threads: result differs from sequential parsing!\n", threads);
+      return 1;
+    }
+    Report(std::to_string(threads) + " thread(s)",
+           Measure([&] { ReadCSV(filename, &pool); }), bytes);
+    if (threads == max_threads) break;
+  }
+
+  // User answers: the answers with the case of every other letter flipped
+  std::vector<std::string> answers;
+  for (size_t i = 0; i < sequential.size(); i++) {
+    std::string ans(sequential.Get(i).answer);
+    for (size_t j = 0; j < ans.size(); j += 2) {
+      if (isalpha((unsigned char)ans[j])) ans[j] ^= 0x20;
+    }
+    answers.push_back(std::move(ans));
+  }
+  auto legacy_ignore_chars = sequential.ignore_chars.CodePoints();
+  std::unordered_set<wchar_t> legacy_ignore(legacy_ignore_chars.begin(),
+                                            legacy_ignore_chars.end());
+  auto ScoreAll = [&](bool legacy) {
+    int total = 0;
+    for (size_t i = 0; i < answers.size(); i++) {
+      Question q = sequential.Get(i);
+      total += legacy ? ScoreLegacy(q, answers[i], legacy_ignore)
+                      : Score(q, answers[i], sequential.ignore_chars);
+    }
+    return total;
+  };
+  if (ScoreAll(false) != ScoreAll(true)) {
+    printf("Scores differ from the legacy scoring!\n");
+    return 1;
+  }
+  printf("\nScoring (%zu answers)\n", answers.size());
+  std::pair<bool, const char*> scorers[] = {
+      {true, "normalize both (legacy)"}, {false, "answer keys + CharClass"}};
+  for (auto& i : scorers) {
+    double t = Measure([&] { ScoreAll(i.first); });
+    printf("%-28s %9.3f ms %9.1f ns/answer\n", i.second, t * 1e3,
+           t / answers.size() * 1e9);
+  }
+  std::vector<UserAnswer> batch;
+  for (size_t i = 0; i < answers.size(); i++) batch.push_back({i, answers[i]});
+  auto scores = ScoreBatch(sequential, batch);
+  if (std::accumulate(scores.begin(), scores.end(), 0) != ScoreAll(false)) {
+    printf("ScoreBatch differs from Score!\n");
+    return 1;
+  }
+  double t = Measure([&] { ScoreBatch(sequential, batch); });
+  printf("%-28s %9.3f ms %9.1f ns/answer\n",
+         ("ScoreBatch, " + std::to_string(DefaultThreadPool().Size()) +
+          " thread(s)").c_str(), t * 1e3, t / answers.size() * 1e9);
+}
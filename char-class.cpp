@@ -0,0 +1,108 @@
+#include "char-class.h"
+
+#include <algorithm>
+#include "utf8.h"
+
+bool CharClass::ContainsNonASCII_(uint32_t code_point) const {
+  auto it = std::upper_bound(
+      ranges_.begin(), ranges_.end(), code_point,
+      [](uint32_t x, const std::pair<uint32_t, uint32_t>& range) {
+        return x < range.first;
+      });
+  return it != ranges_.begin() && code_point <= (--it)->second;
+}
+
+void CharClass::Insert(uint32_t code_point) {
+  if (code_point < 128) {
+    ascii_[code_point >> 6] |= 1ULL << (code_point & 63);
+    return;
+  }
+  if (ContainsNonASCII_(code_point)) return;
+  auto it = std::upper_bound(
+      ranges_.begin(), ranges_.end(), code_point,
+      [](uint32_t x, const std::pair<uint32_t, uint32_t>& range) {
+        return x < range.first;
+      });
+  // Extend the neighboring ranges if adjacent, merging them if both are
+  bool prev = it != ranges_.begin() && (it - 1)->second + 1 == code_point;
+  bool next = it != ranges_.end() && it->first == code_point + 1;
+  if (prev && next) {
+    (it - 1)->second = it->second;
+    ranges_.erase(it);
+  } else if (prev) {
+    (it - 1)->second = code_point;
+  } else if (next) {
+    it->first = code_point;
+  } else {
+    ranges_.insert(it, {code_point, code_point});
+  }
+}
+
+std::vector<uint32_t> CharClass::CodePoints() const {
+  std::vector<uint32_t> ret;
+  for (uint32_t i = 0; i < 128; i++) {
+    if (Contains(i)) ret.push_back(i);
+  }
+  for (auto& i : ranges_) {
+    for (uint32_t j = i.first; j <= i.second; j++) ret.push_back(j);
+  }
+  return ret;
+}
+
+void CharClass::Filter(std::string_view str, bool fold_case,
+                       std::string& out) const {
+  if (empty()) {
+    if (fold_case) {
+      FoldCaseUTF8(str, out);
+    } else {
+      out += str;
+    }
+    return;
+  }
+  const char *p = str.data(), *end = p + str.size();
+  while (p != end) {
+    if ((unsigned char)*p < 0x80) {
+      char ch = *p++;
+      if (!Contains(ch)) out += fold_case ? FoldCaseASCII(ch) : ch;
+      continue;
+    }
+    const char* start = p;
+    uint32_t ch = DecodeUTF8(p, end);
+    if (ch == kInvalidCodePoint) {
+      out += *start;
+    } else if (!ContainsNonASCII_(ch)) {
+      AppendUTF8(fold_case ? FoldCase(ch) : ch, out);
+    }
+  }
+}
+
+bool CharClass::FilteredEquals(std::string_view str, bool fold_case,
+                               std::string_view filtered) const {
+  if (empty() && !fold_case) return str == filtered;
+  const char *p = str.data(), *end = p + str.size();
+  size_t pos = 0;
+  std::string buf; // one encoded code point; always within the SSO buffer
+  while (p != end) {
+    if ((unsigned char)*p < 0x80) {
+      char ch = *p++;
+      if (Contains(ch)) continue;
+      if (fold_case) ch = FoldCaseASCII(ch);
+      if (pos == filtered.size() || filtered[pos] != ch) return false;
+      pos++;
+      continue;
+    }
+    const char* start = p;
+    uint32_t ch = DecodeUTF8(p, end);
+    buf.clear();
+    if (ch == kInvalidCodePoint) {
+      buf += *start;
+    } else if (ContainsNonASCII_(ch)) {
+      continue;
+    } else {
+      AppendUTF8(fold_case ? FoldCase(ch) : ch, buf);
+    }
+    if (filtered.compare(pos, buf.size(), buf)) return false;
+    pos += buf.size();
+  }
+  return pos == filtered.size();
+}
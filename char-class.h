@@ -0,0 +1,37 @@
+#ifndef CHAR_CLASS_H_
+#define CHAR_CLASS_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+// A set of code points, as the ignored characters of a question file.
+// ASCII is kept in a bitmap; other code points in sorted, disjoint ranges,
+// which stay few since ignored characters are usually punctuation runs.
+class CharClass {
+  uint64_t ascii_[2] = {};
+  std::vector<std::pair<uint32_t, uint32_t>> ranges_; // [first, last]
+  bool ContainsNonASCII_(uint32_t code_point) const;
+ public:
+  void Insert(uint32_t code_point);
+  bool Contains(uint32_t code_point) const {
+    if (code_point < 128) {
+      return ascii_[code_point >> 6] >> (code_point & 63) & 1;
+    }
+    return ContainsNonASCII_(code_point);
+  }
+  bool empty() const { return !ascii_[0] && !ascii_[1] && ranges_.empty(); }
+  // In increasing order
+  std::vector<uint32_t> CodePoints() const;
+
+  // Appends `str` with the code points of the class removed, and the case
+  // folded if `fold_case` is set. Malformed bytes are copied as is.
+  void Filter(std::string_view str, bool fold_case, std::string& out) const;
+  // Whether Filter(str, fold_case) would be equal to `filtered`, without
+  // building the filtered string
+  bool FilteredEquals(std::string_view str, bool fold_case,
+                      std::string_view filtered) const;
+};
+
+#endif // CHAR_CLASS_H_
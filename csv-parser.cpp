@@ -0,0 +1,324 @@
+#include "csv-parser.h"
+
+#include <map>
+#include <memory>
+#include <cstring>
+#include "thread-pool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSV_PARSER_X86
+#endif
+
+namespace {
+
+// Scanners return the first byte in [p, end) that the state machine has to look
+// at: a quote inside quotes, or one of ',' '"' '\r' '\n' 0xfe 0xff outside.
+// All bytes before it are ordinary field content.
+using ScanFunc = const char* (*)(const char* p, const char* end, bool quoted);
+
+inline bool IsSpecial(unsigned char ch) {
+  return ch == ',' || ch == '\"' || ch == '\r' || ch == '\n' || ch >= 0xfe;
+}
+
+const char* ScanScalar(const char* p, const char* end, bool quoted) {
+  if (quoted) {
+    while (p != end && *p != '\"') ++p;
+  } else {
+    while (p != end && !IsSpecial(*p)) ++p;
+  }
+  return p;
+}
+
+#ifdef CSV_PARSER_X86
+__attribute__((target("sse2")))
+const char* ScanSSE2(const char* p, const char* end, bool quoted) {
+  const __m128i quote = _mm_set1_epi8('\"');
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i bom = _mm_set1_epi8((char)0xfe);
+  for (; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i m = _mm_cmpeq_epi8(x, quote);
+    if (!quoted) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(x, comma));
+      m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, cr),
+                                       _mm_cmpeq_epi8(x, lf)));
+      // unsigned x >= 0xfe
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(x, bom), x));
+    }
+    int mask = _mm_movemask_epi8(m);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return ScanScalar(p, end, quoted);
+}
+
+__attribute__((target("avx2")))
+const char* ScanAVX2(const char* p, const char* end, bool quoted) {
+  const __m256i quote = _mm256_set1_epi8('\"');
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i bom = _mm256_set1_epi8((char)0xfe);
+  for (; end - p >= 32; p += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i m = _mm256_cmpeq_epi8(x, quote);
+    if (!quoted) {
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, comma));
+      m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, cr),
+                                             _mm256_cmpeq_epi8(x, lf)));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_max_epu8(x, bom), x));
+    }
+    unsigned mask = _mm256_movemask_epi8(m);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return ScanSSE2(p, end, quoted);
+}
+#endif
+
+bool Supported(CSVScanner type) {
+  switch (type) {
+    case CSVScanner::kScalar: return true;
+#ifdef CSV_PARSER_X86
+    case CSVScanner::kSSE2: return __builtin_cpu_supports("sse2");
+    case CSVScanner::kAVX2: return __builtin_cpu_supports("avx2");
+#endif
+    default: return false;
+  }
+}
+
+CSVScanner BestScanner() {
+  for (auto i : {CSVScanner::kAVX2, CSVScanner::kSSE2}) {
+    if (Supported(i)) return i;
+  }
+  return CSVScanner::kScalar;
+}
+
+ScanFunc GetScanFunc(CSVScanner type) {
+  switch (type) {
+#ifdef CSV_PARSER_X86
+    case CSVScanner::kSSE2: return ScanSSE2;
+    case CSVScanner::kAVX2: return ScanAVX2;
+#endif
+    default: return ScanScalar;
+  }
+}
+
+CSVScanner scanner_type = BestScanner();
+ScanFunc scan = GetScanFunc(scanner_type);
+
+// Collects the bytes of a field. It stays a view into the buffer as long as
+// the collected bytes are contiguous, and is copied to the output otherwise.
+class FieldBuilder {
+  const char* start_;
+  size_t len_;
+  char*& out_;
+  bool copied_;
+  void Copy_(const char* p, size_t n) {
+    memcpy(out_, start_, len_);
+    memcpy(out_ + len_, p, n);
+    start_ = out_;
+    len_ += n;
+    copied_ = true;
+  }
+ public:
+  FieldBuilder(char*& out)
+      : start_(nullptr), len_(0), out_(out), copied_(false) {}
+  void Push(const char* p) {
+    if (copied_) {
+      out_[len_++] = *p;
+    } else if (!len_) {
+      start_ = p;
+      len_ = 1;
+    } else if (p == start_ + len_) {
+      ++len_;
+    } else {
+      Copy_(p, 1);
+    }
+  }
+  void PushRange(const char* p, size_t n) {
+    if (!n) return;
+    if (copied_) {
+      memcpy(out_ + len_, p, n);
+      len_ += n;
+    } else if (!len_) {
+      start_ = p;
+      len_ = n;
+    } else if (p == start_ + len_) {
+      len_ += n;
+    } else {
+      Copy_(p, n);
+    }
+  }
+  bool Empty() const { return !len_; }
+  void Emit(std::vector<std::string_view>& fields) {
+    fields.emplace_back(start_, len_);
+    if (copied_) {
+      out_ += len_;
+      copied_ = false;
+    }
+    len_ = 0;
+  }
+};
+
+// States of the record splitter; the same as `in_quote` in NextRecord, plus
+// the byte after '\r' and the start of a record
+enum SplitState {
+  kUnquoted, kQuoted, kAfterQuote, kSkipByte, kRecordStart, kSplitStates
+};
+
+// Runs the state machine of NextRecord over [p, end) without collecting
+// fields. If `stop` is set, stops at the first record start.
+const char* Advance(const char* p, const char* end, int& state, bool stop) {
+  while (p != end) {
+    if (state != kAfterQuote && state != kSkipByte) {
+      const char* next = scan(p, end, state == kQuoted);
+      if (next != p && state == kRecordStart) state = kUnquoted;
+      if ((p = next) == end) break;
+    }
+    char ch = *p++;
+    switch (state) {
+      case kRecordStart: case kUnquoted:
+        switch (ch) {
+          case '\"': state = kQuoted; break;
+          case '\r': state = kSkipByte; break;
+          case '\n': state = kRecordStart; break;
+          default: state = kUnquoted;
+        }
+        break;
+      case kQuoted: state = kAfterQuote; break; // must be '"'
+      case kAfterQuote:
+        if (ch == '\"') {
+          state = kQuoted;
+        } else if (ch != ',') {
+          state = kUnquoted;
+        }
+        break;
+      case kSkipByte: state = kRecordStart; break;
+    }
+    if (stop && state == kRecordStart) break;
+  }
+  return p;
+}
+
+} // namespace
+
+bool SetCSVScanner(CSVScanner type) {
+  if (type == CSVScanner::kAuto) type = BestScanner();
+  if (!Supported(type)) return false;
+  scanner_type = type;
+  scan = GetScanFunc(type);
+  return true;
+}
+
+CSVScanner GetCSVScanner() {
+  return scanner_type;
+}
+
+bool CSVParser::NextRecord(std::vector<std::string_view>& fields) {
+  fields.clear();
+  FieldBuilder current(out_);
+  int in_quote = 0;
+  while (cur_ != end_) {
+    if (in_quote != 2) { // skip ordinary bytes in bulk
+      const char* next = scan(cur_, end_, in_quote == 1);
+      current.PushRange(cur_, next - cur_);
+      cur_ = next;
+      if (cur_ == end_) break;
+    }
+    const char* p = cur_++;
+    char ch = *p;
+    if (in_quote == 2) {
+      if (ch == ',') {
+        current.Emit(fields);
+      } else if (ch == '\"') {
+        in_quote = 1;
+        current.Push(p);
+      } else { // error
+        in_quote = 0;
+        current.Push(p);
+      }
+    } else if (in_quote == 1) {
+      if (ch == '\"') {
+        in_quote = 2;
+      } else {
+        current.Push(p);
+      }
+    } else {
+      switch (ch) {
+        case '\"': in_quote = 1; break;
+        case ',': current.Emit(fields); break;
+        case '\r': if (cur_ != end_) ++cur_; [[fallthrough]]; // should be '\n'
+        case '\n': current.Emit(fields); return true;
+        case (char)0xfe: case (char)0xff: break; // Invalid UTF-8; ignore because of BOM
+        default: current.Push(p);
+      }
+    }
+  }
+  // Buffer ends before EOL; technically invalid CSV
+  if (!current.Empty()) current.Emit(fields);
+  return fields.size(); // false: after last '\n'
+}
+
+bool CSVParser::SkipRecord() {
+  if (cur_ == end_) return false;
+  int state = kRecordStart;
+  const char* next = Advance(cur_, end_, state, true);
+  if (state != kRecordStart) { // the last record misses its line break
+    std::vector<std::string_view> fields;
+    std::unique_ptr<char[]> out(new char[end_ - cur_]);
+    char* saved = out_;
+    out_ = out.get();
+    bool ret = NextRecord(fields);
+    out_ = saved;
+    return ret;
+  }
+  cur_ = next;
+  return true;
+}
+
+std::vector<const char*> SplitCSVRecords(const char* begin, const char* end,
+                                         size_t pieces, ThreadPool& pool) {
+  size_t size = end - begin;
+  pieces = std::max((size_t)1, std::min(pieces, size));
+  std::vector<const char*> cuts;
+  for (size_t i = 0; i <= pieces; i++) cuts.push_back(begin + size * i / pieces);
+  // For each chunk and entry state: the first record start in the chunk (or
+  // nullptr) and the state at the end of the chunk
+  struct Transition {
+    const char* first[kSplitStates];
+    int exit[kSplitStates];
+  };
+  std::vector<Transition> trans(pieces);
+  pool.ParallelFor(pieces, [&](size_t k) {
+    const char *start = cuts[k], *stop = cuts[k + 1];
+    // Runs from the same record start are identical
+    std::map<const char*, int> rest;
+    for (int s = 0; s < kSplitStates; s++) {
+      if (k == 0 && s != kRecordStart) continue;
+      int state = s;
+      const char* p = start;
+      if (s != kRecordStart) p = Advance(start, stop, state, true);
+      trans[k].first[s] = state == kRecordStart && p != stop ? p : nullptr;
+      if (state == kRecordStart) {
+        auto it = rest.find(p);
+        if (it == rest.end()) {
+          Advance(p, stop, state, false);
+          it = rest.emplace(p, state).first;
+        }
+        state = it->second;
+      }
+      trans[k].exit[s] = state;
+    }
+  });
+  std::vector<const char*> ret = {begin};
+  int state = kRecordStart;
+  for (size_t k = 0; k < pieces; k++) {
+    const char* first = trans[k].first[state];
+    if (first && first != begin) ret.push_back(first);
+    state = trans[k].exit[state];
+  }
+  ret.push_back(end);
+  return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef CSV_PARSER_H_
+#define CSV_PARSER_H_
+
+#include <string>
+#include <vector>
+#include <string_view>
+
+// Implementations of the scanner that skips over ordinary bytes. kAuto picks
+// the fastest one supported by the CPU at startup.
+enum class CSVScanner { kAuto, kScalar, kSSE2, kAVX2 };
+
+// Returns false (and keeps the current one) if the CPU lacks support.
+bool SetCSVScanner(CSVScanner);
+CSVScanner GetCSVScanner();
+
+// Splits an in-memory CSV buffer into records.
+// The rules are exactly those of the original stream-based parser, quirks
+// included:
+// - A quote starts a quoted part anywhere in a field, and the next quote ends
+//   it. A quote right after the end of a quoted part is a literal quote and
+//   starts a quoted part again; a comma there ends the field while the
+//   "after quote" state carries on into the next field; any other character is
+//   taken literally and ends the quoted state.
+// - '\r' outside quotes ends the record and consumes the next byte (assumed to
+//   be '\n').
+// - 0xfe and 0xff outside quotes are dropped (BOM).
+// - The last record may miss its line break; a trailing empty field is
+//   dropped in this case.
+class CSVParser {
+  const char* cur_;
+  const char* end_;
+  char* out_;
+ public:
+  // Decoded fields are written to `out`, which must have room for
+  // `end - begin` bytes (decoding never produces more than it consumes). It
+  // may be null if no record is read with NextRecord.
+  CSVParser(const char* begin, const char* end, char* out = nullptr)
+      : cur_(begin), end_(end), out_(out) {}
+  const char* Position() const { return cur_; }
+  // Next byte of the output to be written
+  char* Output() const { return out_; }
+  bool AtEnd() const { return cur_ == end_; }
+  // Fields whose content is a contiguous range of the buffer are returned as
+  // views into it; the others (escaped quotes, BOM) are decoded into the
+  // output. Returns false if there is no record left.
+  bool NextRecord(std::vector<std::string_view>& fields);
+  // Moves past the next record without collecting its fields. Returns the same
+  // as NextRecord would.
+  bool SkipRecord();
+};
+
+class ThreadPool;
+
+// Splits [begin, end) into at most `pieces` consecutive ranges that start at
+// record boundaries, so that parsing each range with its own CSVParser gives
+// the same records as parsing the whole buffer. `begin` must be a record
+// start. Returns the boundaries, including `begin` and `end`.
+// The buffer is cut into chunks which are scanned in parallel, each one for
+// every state it may be entered in; the actual state at each cut is then
+// resolved from the start.
+std::vector<const char*> SplitCSVRecords(const char* begin, const char* end,
+                                         size_t pieces, ThreadPool& pool);
+
+#endif // CSV_PARSER_H_
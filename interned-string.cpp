@@ -0,0 +1,36 @@
+#include "interned-string.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+const std::string kEmpty;
+
+struct Pool {
+  std::mutex mutex;
+  std::deque<std::string> strings; // elements never move
+  std::unordered_map<std::string_view, const std::string*> index;
+};
+
+Pool& GetPool() {
+  static Pool pool;
+  return pool;
+}
+
+} // namespace
+
+InternedString::InternedString() : str_(&kEmpty) {}
+
+InternedString::InternedString(std::string_view str) : str_(&kEmpty) {
+  if (str.empty()) return;
+  Pool& pool = GetPool();
+  std::lock_guard<std::mutex> lck(pool.mutex);
+  auto it = pool.index.find(str);
+  if (it == pool.index.end()) {
+    const std::string& stored = pool.strings.emplace_back(str);
+    it = pool.index.emplace(stored, &stored).first;
+  }
+  str_ = it->second;
+}
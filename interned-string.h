@@ -0,0 +1,37 @@
+#ifndef INTERNED_STRING_H_
+#define INTERNED_STRING_H_
+
+#include <string>
+#include <string_view>
+
+// An immutable string stored once per distinct value for the whole program,
+// as the question file paths repeated across the history. Copying and
+// comparing are pointer operations; the strings are never freed.
+class InternedString {
+  const std::string* str_;
+ public:
+  InternedString();
+  InternedString(std::string_view str);
+  InternedString(const std::string& str)
+      : InternedString(std::string_view(str)) {}
+  InternedString(const char* str) : InternedString(std::string_view(str)) {}
+  const std::string& str() const { return *str_; }
+  operator const std::string&() const { return *str_; }
+  const char* c_str() const { return str_->c_str(); }
+  size_t size() const { return str_->size(); }
+  bool empty() const { return str_->empty(); }
+  bool operator==(const InternedString& x) const { return str_ == x.str_; }
+  bool operator!=(const InternedString& x) const { return str_ != x.str_; }
+};
+
+namespace std {
+
+template <> struct hash<InternedString> {
+  size_t operator()(const InternedString& x) const {
+    return hash<const std::string*>()(&x.str());
+  }
+};
+
+} // namespace std
+
+#endif // INTERNED_STRING_H_
@@ -4,16 +4,20 @@
 #include <thread>
 #include <random>
 #include <fstream>
+#include <charconv>
 #include <iostream>
 #include <algorithm>
 #include <filesystem>
 #include "qa-screens.h"
 #include "qa-file.h"
+#include "qa-bank.h"
+#include "qa-history.h"
+#include "csv-parser.h"
 
 QuestionSet question_set;
 TestResult current;
 size_t now_id;
-std::deque<TestResult> history;
+HistoryStore history;
 std::vector<std::string> answers;
 std::chrono::time_point<std::chrono::steady_clock> start_time;
 std::string history_path;
@@ -36,19 +40,34 @@ const std::string kFileError =
     "Error: Empty question file or question file does not exist.";
 const std::string kHistError =
     "Error: Failed to load result. Question file seems to be changed.";
+const std::string kHistReadError =
+    "Error: Failed to read the result from the history file.";
+const std::string kHistWriteError =
+    "Error: Failed to save the result to the history file";
 const std::string kNumberError = "Error: Invalid number of questions.";
 const std::string kExportError = "Error: Cannot open the file to export.";
 
 inline void SetTitle(ScreenWithTitle* scr) {
-  if (question_set.questions.empty()) {
+  if (question_set.empty()) {
     scr->SetTitle("Welcome to Q&A System!");
   } else {
     scr->SetTitle(question_set.title);
   }
 }
 
+// Shows the last failure of saving history, if any
+template <class Screen>
+inline void SetHistoryError(Screen* scr) {
+  std::string error = history.Error();
+  if (error.size()) {
+    scr->SetMessage(kHistWriteError + " (" + error + ")");
+  } else if (history.Note().size()) {
+    scr->SetMessage(history.Note());
+  }
+}
+
 QAScreen ShowTitleScreen() {
-  if (question_set.questions.empty()) {
+  if (question_set.empty()) {
     QAScreen results[] = {kOpenQuestion, kHistory, kHowTo, kExit};
     MenuScreen scr({"Open question file", "View history",
                     "How to: Make a question file", "Exit"});
@@ -76,9 +95,9 @@ QAScreen ShowOpenQuestionScreen() {
     while (!scr.ProcessKey(getch())) doupdate();
     std::string filename = scr.GetValue();
     if (filename.empty()) return kTitle;
-    question_set = ReadCSV(filename);
-    if (question_set.questions.size()) {
-      current.file = std::filesystem::absolute(filename);
+    question_set = OpenQuestionSet(filename);
+    if (question_set.size()) {
+      current.file = std::filesystem::absolute(filename).string();
       return kTitle;
     }
     scr.SetMessage(kFileError);
@@ -86,56 +105,103 @@ QAScreen ShowOpenQuestionScreen() {
   }
 }
 
+// Asks for a history filter; a blank one shows everything
+void ShowFilterScreen(HistoryQuery& query, std::string& filter) {
+  PromptScreen scr(
+      "Enter a filter, or leave it blank to show all results.\n"
+      "Terms (separated by spaces): part of the file path, from:DATE, "
+      "to:DATE (DATE is YYYY, YYYY-MM or YYYY-MM-DD), score:MIN-MAX\n"
+      "Press <ESC> to keep the current filter.");
+  scr.SetValue(filter);
+  SetTitle(&scr);
+  doupdate();
+  while (true) {
+    for (int ch; !scr.ProcessKey(ch = getch());) {
+      if (ch == 27) return; // query still matches filter
+      doupdate();
+    }
+    HistoryQuery parsed;
+    std::string error;
+    if (ParseHistoryQuery(scr.GetValue(), parsed, error)) {
+      query = std::move(parsed);
+      filter = scr.GetValue();
+      return;
+    }
+    scr.SetMessage("Error: " + error);
+    doupdate();
+  }
+}
+
 QAScreen ShowHistoryScreen() {
-  const int kMargin = 2;
-  std::vector<std::string> hist;
-  for (auto& i : history) hist.push_back(i.GetMenuText(COLS-kMargin));
+  history.Refresh(); // results of other instances
+  HistoryQuery query;
+  std::string filter;
+  std::vector<size_t> shown = history.Find(query);
+  auto GenRow = [&](size_t i, int width) {
+    return history[shown[i]].GetMenuText(width);
+  };
   auto GenHeader = [&](int width) {
-    return "Select an entry to view detailed results or take the test again.\n"
-           "Press <ESC> to leave.\n\nFilename" +
-           std::string(width - kHistoryHeader.size() - 8, ' ') + kHistoryHeader;
+    std::string ret =
+        "Select an entry to view detailed results or take the test again.\n"
+        "Press / to filter, <ESC> to leave.\n";
+    if (filter.size()) {
+      ret += "Filter: " + filter + " (" + std::to_string(shown.size()) +
+             " results)";
+    }
+    return ret + "\nFilename" +
+           std::string(width - kHistoryHeader.size() - 8, ' ') +
+           kHistoryHeader;
   };
-  MenuScreen scr(hist, GenHeader(COLS - kMargin));
+  ListScreen scr(shown.size(), GenRow, GenHeader);
+  SetHistoryError(&scr);
   SetTitle(&scr);
   doupdate();
   while (true) {
     while (true) {
-      bool ret =
-          scr.ProcessKey(getch(), [&](auto& header, auto& hist, int, int w) {
-            hist.clear();
-            for (auto& i : history) hist.push_back(i.GetMenuText(w));
-            header = GenHeader(w);
-          });
-      if (ret) break;
+      int ch = getch();
+      if (ch == '/') {
+        ShowFilterScreen(query, filter);
+        shown = history.Find(query);
+        scr.SetSize(shown.size());
+        SetTitle(&scr);
+        doupdate();
+        continue;
+      }
+      if (scr.ProcessKey(ch)) break;
       doupdate();
     }
     int val = scr.GetValue();
     if (val == -1) {
-      question_set.questions.clear();
+      question_set.Clear();
       return kTitle;
     }
-    auto& i = history[val];
-    question_set = ReadCSV(i.file);
-    if (question_set.questions.empty()) {
+    TestResult i;
+    if (!history.Load(shown[val], i)) {
+      scr.SetMessage(kHistReadError);
+      doupdate();
+      continue;
+    }
+    question_set = OpenQuestionSet(i.file);
+    if (question_set.empty()) {
       scr.SetMessage(kFileError);
       doupdate();
       continue;
     }
     bool flag = false;
     for (auto& j : i.ord) {
-      if (j >= question_set.questions.size()) {
+      if (j >= question_set.size()) {
         flag = true;
         break;
       }
     }
     for (auto& j : i.unsure) {
-      if (j >= question_set.questions.size()) {
+      if (j >= question_set.size()) {
         flag = true;
         break;
       }
     }
-    for (auto& j : i.wa) {
-      if (j.id >= question_set.questions.size()) {
+    for (auto j : i.wa) {
+      if (j.id >= question_set.size()) {
         flag = true;
         break;
       }
@@ -143,7 +209,7 @@ QAScreen ShowHistoryScreen() {
     if (flag) {
       scr.SetMessage(kHistError);
       doupdate();
-      question_set.questions.clear();
+      question_set.Clear();
       continue;
     }
     current = i;
@@ -175,16 +241,16 @@ QAScreen ShowHowToScreen() {
 
 QAScreen ShowQuestionNumScreen() {
   int num = 1;
-  if (question_set.questions.size() > 1) {
+  if (question_set.size() > 1) {
     PromptScreen scr("Input the number of questions you want to practice (1~" +
-                     std::to_string(question_set.questions.size()) + "):");
+                     std::to_string(question_set.size()) + "):");
     SetTitle(&scr);
     doupdate();
     while (true) {
       while (!scr.ProcessKey(getch())) doupdate();
       try {
         num = std::stoi(scr.GetValue());
-        if (num >= 1 && num <= (int)question_set.questions.size()) break;
+        if (num >= 1 && num <= (int)question_set.size()) break;
       } catch (...) {}
       scr.SetMessage(kNumberError);
       doupdate();
@@ -193,7 +259,7 @@ QAScreen ShowQuestionNumScreen() {
   // file: set, others: not yet
   auto& ord = current.ord;
   ord.clear();
-  for (size_t i = 0; i < question_set.questions.size(); i++) ord.push_back(i);
+  for (size_t i = 0; i < question_set.size(); i++) ord.push_back(i);
   std::shuffle(ord.begin(), ord.end(), rand_gen);
   ord.resize(num);
   return kPrepare;
@@ -225,7 +291,7 @@ QAScreen ShowPrepareScreen() {
 
 QAScreen ShowQuestionScreen() {
   size_t id = current.ord[now_id];
-  QuestionScreen scr(question_set.questions[id].description,
+  QuestionScreen scr(std::string(question_set.Get(id).description),
                      (double)now_id / current.ord.size());
   SetTitle(&scr);
   doupdate();
@@ -252,17 +318,18 @@ QAScreen ShowQuestionScreen() {
     current.finish = time(nullptr);
     current.score = 0;
     current.fullmark = 0;
+    std::vector<UserAnswer> batch;
+    for (size_t i = 0; i < current.ord.size(); i++) {
+      batch.push_back({current.ord[i], answers[i]});
+    }
+    std::vector<int> scores = ScoreBatch(question_set, batch);
     for (size_t i = 0; i < current.ord.size(); i++) {
-      size_t id = current.ord[i];
-      int score = Score(question_set.questions[id], answers[i],
-                        question_set.ignore_chars);
-      if (score < 1) current.wa.push_back({id, answers[i]});
-      current.score += score;
+      if (scores[i] < 1) current.wa.push_back({current.ord[i], answers[i]});
+      current.score += scores[i];
       current.fullmark += 1;
     }
     answers.clear();
-    history.push_front(current);
-    ExportHistory(history_path, history);
+    history.Append(current);
     return kFinished;
   }
   return kQuestion;
@@ -283,6 +350,7 @@ QAScreen ShowFinishedScreen() {
     choices.erase(choices.begin() + 1);
   }
   MenuScreen scr(choices, current.GetSummary(false));
+  SetHistoryError(&scr);
   SetTitle(&scr);
   doupdate();
   while (!scr.ProcessKey(getch())) doupdate();
@@ -291,7 +359,7 @@ QAScreen ShowFinishedScreen() {
     auto& ord = current.ord;
     ord.clear();
     for (auto& i : current.unsure) ord.push_back(i);
-    for (auto& i : current.wa) ord.push_back(i.id);
+    for (auto i : current.wa) ord.push_back(i.id);
     std::sort(ord.begin(), ord.end());
     ord.resize(std::unique(ord.begin(), ord.end()) - ord.begin());
     std::shuffle(ord.begin(), ord.end(), rand_gen);
@@ -348,19 +416,76 @@ void MainLoop() {
 
 const int kTitleColorPair = 1;
 
-int main() {
+// Grades an answer file whose rows are (question number, answer), as given in
+// reviews. Prints the score of each row as CSV, and the total to stderr.
+int GradeAnswers(const std::string& questions, const std::string& answers) {
+  QuestionSet qs = OpenQuestionSet(questions);
+  if (qs.empty()) {
+    std::cerr << "Failed reading " << questions << "." << std::endl;
+    return 1;
+  }
+  MappedFile file;
+  if (!file.Open(answers)) {
+    std::cerr << "Failed reading " << answers << "." << std::endl;
+    return 1;
+  }
+  StringArena arena(file.size());
+  CSVParser parser(file.begin(), file.end(), arena.data());
+  std::vector<std::string_view> line;
+  std::vector<UserAnswer> batch;
+  for (size_t row = 1; parser.NextRecord(line); row++) {
+    if (line.empty() || (line.size() == 1 && line[0].empty())) continue;
+    size_t num = 0;
+    const char* end = line[0].data() + line[0].size();
+    auto res = std::from_chars(line[0].data(), end, num);
+    if (res.ec != std::errc() || res.ptr != end || num < 1 ||
+        num > qs.size()) {
+      std::cerr << answers << ", row " << row << ": invalid question number."
+                << std::endl;
+      return 1;
+    }
+    batch.push_back({num - 1, line.size() > 1 ? line[1] : std::string_view()});
+  }
+  std::vector<int> scores = ScoreBatch(qs, batch);
+  int score = 0;
+  for (size_t i = 0; i < batch.size(); i++) {
+    std::cout << batch[i].id + 1 << ',' << scores[i] << '\n';
+    score += scores[i];
+  }
+  std::cout.flush();
+  std::cerr << "Score: " << score << '/' << batch.size() << std::endl;
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && argv[1] == std::string("--compile")) {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " --compile FILE..." << std::endl;
+      return 1;
+    }
+    int ret = 0;
+    for (int i = 2; i < argc; i++) {
+      if (!CompileBank(argv[i], BankPath(argv[i]))) {
+        std::cerr << "Failed compiling " << argv[i] << "." << std::endl;
+        ret = 1;
+      }
+    }
+    return ret;
+  }
+  if (argc > 1 && argv[1] == std::string("--grade")) {
+    if (argc != 4) {
+      std::cerr << "Usage: " << argv[0] << " --grade QUESTIONS ANSWERS"
+                << std::endl;
+      return 1;
+    }
+    return GradeAnswers(argv[2], argv[3]);
+  }
   rand_gen.seed(std::chrono::duration_cast<std::chrono::nanoseconds>(
                     std::chrono::system_clock::now().time_since_epoch())
                     .count());
   char* home = getenv("HOME");
   history_path = home ? (std::string)home + "/.qa_system.hist" : ".qa_system.hist";
-  try {
-    history = ReadHistory(history_path);
-  } catch (...) {
-    std::cerr << "Failed reading history file " << history_path
-        << ".\nFix the history file or delete it." << std::endl;
-    return 1;
-  }
+  history.Open(history_path);
 
   std::setlocale(LC_ALL, "");
   std::setlocale(LC_CTYPE, "");
@@ -374,4 +499,11 @@ int main() {
   MainLoop();
 
   endwin();
+  if (history.Note().size()) std::cerr << history.Note() << std::endl;
+  history.Flush();
+  if (history.Error().size()) {
+    std::cerr << "Failed saving history to " << history_path << " ("
+        << history.Error() << ")." << std::endl;
+    return 1;
+  }
 }
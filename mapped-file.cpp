@@ -0,0 +1,65 @@
+#include "mapped-file.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFile::MappedFile()
+    : data_(nullptr), size_(0), mapped_(false), open_(false) {}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const std::string& filename, bool sequential) {
+  Close();
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr != MAP_FAILED) {
+      madvise(ptr, st.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+      data_ = static_cast<const char*>(ptr);
+      size_ = st.st_size;
+      mapped_ = true;
+    }
+  }
+  if (!mapped_) { // fallback: read everything
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) buffer_.append(buf, n);
+    if (n < 0) {
+      close(fd);
+      buffer_.clear();
+      return false;
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+  }
+  close(fd);
+  open_ = true;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (mapped_) munmap(const_cast<char*>(data_), size_);
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+  open_ = false;
+}
+
+void MappedFile::Release() {
+  if (!mapped_) return;
+  void* ptr = const_cast<char*>(data_);
+  madvise(ptr, size_, MADV_DONTNEED);
+  madvise(ptr, size_, MADV_RANDOM);
+}
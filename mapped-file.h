@@ -0,0 +1,34 @@
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <string>
+#include <string_view>
+
+// Read-only content of a whole file. Regular files are mmap'ed; if that is not
+// possible (pipes, special files), the content is read into memory instead.
+// The data stays at the same address until the object is destroyed.
+class MappedFile {
+  const char* data_;
+  size_t size_;
+  bool mapped_, open_;
+  std::string buffer_;
+ public:
+  MappedFile();
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  // `sequential`: hint that the content will be read from start to end
+  bool Open(const std::string& filename, bool sequential = true);
+  void Close();
+  // Drops the pages read so far from memory; they are read from the file again
+  // on the next access. Also hints random access from now on.
+  void Release();
+  bool IsOpen() const { return open_; }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+  std::string_view View() const { return {data_, size_}; }
+};
+
+#endif // MAPPED_FILE_H_
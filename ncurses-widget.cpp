@@ -1,27 +1,177 @@
 #include "ncurses-widget.h"
 
+#include <cstring>
+#include <algorithm>
+
 // Buffer
 
+static inline bool IsContinuation(unsigned char ch) {
+  return 0x80 <= ch && ch < 0xc0;
+}
+
+// Length of the UTF-8 sequence led by `ch`, or 0 if it is not a lead byte
+static inline size_t SequenceLength(unsigned char ch) {
+  if (ch < 0xc2 || ch > 0xf4) return 0;
+  return ch < 0xe0 ? 2 : ch < 0xf0 ? 3 : 4;
+}
+
 Buffer::Buffer(int maxheight)
-    : buf_(),
-      cur_(buf_.begin()),
+    : gap_begin_(0),
+      gap_end_(0),
+      cur_(0),
+      drawn_(0),
+      history_bytes_(0),
+      max_edits_(1000),
+      max_bytes_(1 << 20),
+      coalesce_(false),
       maxheight_(maxheight),
-      maxcol_(0),
       dirty_(false) {}
 
+int Buffer::Row_(size_t i) const {
+  return std::upper_bound(rows_.begin(), rows_.end(), i) - rows_.begin();
+}
+
+bool Buffer::CutShort_(size_t i) const {
+  size_t len = SequenceLength(At_(i));
+  if (len > size() - i) return true;
+  for (size_t j = 1; j < len; j++) {
+    if (!IsContinuation(At_(i + j))) return true;
+  }
+  return false;
+}
+
+void Buffer::MoveGap_(size_t pos) {
+  char* data = text_.data();
+  if (pos < gap_begin_) {
+    size_t n = gap_begin_ - pos;
+    memmove(data + gap_end_ - n, data + pos, n);
+    gap_begin_ -= n;
+    gap_end_ -= n;
+  } else if (pos > gap_begin_) {
+    size_t n = pos - gap_begin_;
+    memmove(data + gap_begin_, data + gap_end_, n);
+    gap_begin_ += n;
+    gap_end_ += n;
+  }
+}
+
+void Buffer::Insert_(size_t pos, std::string_view str) {
+  drawn_ = std::min(drawn_, pos);
+  MoveGap_(pos);
+  if (gap_end_ - gap_begin_ < str.size()) { // grow geometrically
+    size_t tail = text_.size() - gap_end_;
+    size_t cap = std::max(text_.size() * 2, size() + str.size() + 64);
+    text_.resize(cap);
+    memmove(text_.data() + cap - tail, text_.data() + gap_end_, tail);
+    gap_end_ = cap - tail;
+  }
+  memcpy(text_.data() + gap_begin_, str.data(), str.size());
+  gap_begin_ += str.size();
+}
+
+std::string_view Buffer::Erase_(size_t begin, size_t end) {
+  drawn_ = std::min(drawn_, begin);
+  MoveGap_(begin);
+  std::string_view ret(text_.data() + gap_end_, end - begin);
+  gap_end_ += end - begin;
+  return ret;
+}
+
+void Buffer::BeginEvent_() {
+  prev_.start = prev_.cur = cur_;
+  prev_.inserted = 0;
+  prev_.removed.clear();
+  dirty_ = true;
+}
+
+void Buffer::Rollback_() {
+  if (!dirty_) return;
+  dirty_ = false;
+  Erase_(prev_.start, prev_.start + prev_.inserted);
+  Insert_(prev_.start, prev_.removed);
+  cur_ = prev_.cur;
+}
+
+bool Buffer::Commit_() {
+  if (!dirty_ || (!prev_.inserted && prev_.removed.empty())) return false;
+  MoveGap_(prev_.start + prev_.inserted);
+  std::string_view inserted(text_.data() + prev_.start, prev_.inserted);
+  std::string_view removed = prev_.removed;
+  Edit_* last = coalesce_ && !undo_.empty() && undo_.back().first
+                    ? &undo_.back() : nullptr;
+  if (last && removed.empty() && !last->removed &&
+      last->pos + last->bytes.size() == prev_.start) { // typing
+    last->bytes += inserted;
+    last->after = cur_;
+    history_bytes_ += inserted.size();
+  } else if (last && inserted.empty() && last->bytes.size() == last->removed &&
+             (prev_.start == last->pos ||
+              prev_.start + removed.size() == last->pos)) {
+    if (prev_.start == last->pos) { // deleting
+      last->bytes += removed;
+    } else { // backspacing
+      last->bytes.insert(0, removed);
+      last->pos = prev_.start;
+    }
+    last->removed += removed.size();
+    last->after = cur_;
+    history_bytes_ += removed.size();
+  } else {
+    Push_(prev_.start, removed, inserted, prev_.cur, cur_, true);
+  }
+  coalesce_ = true;
+  Trim_();
+  return true;
+}
+
+void Buffer::Push_(size_t pos, std::string_view removed,
+                   std::string_view inserted, size_t before, size_t after,
+                   bool first) {
+  for (auto& i : redo_) history_bytes_ -= i.bytes.size();
+  redo_.clear();
+  Edit_& edit = undo_.emplace_back();
+  edit.pos = pos;
+  edit.removed = removed.size();
+  edit.before = before;
+  edit.after = after;
+  edit.first = first;
+  edit.bytes.reserve(removed.size() + inserted.size());
+  edit.bytes += removed;
+  edit.bytes += inserted;
+  history_bytes_ += edit.bytes.size();
+}
+
+void Buffer::Trim_() {
+  while (!undo_.empty() &&
+         (undo_.size() > max_edits_ || history_bytes_ > max_bytes_)) {
+    do { // drop the oldest group
+      history_bytes_ -= undo_.front().bytes.size();
+      undo_.pop_front();
+    } while (!undo_.empty() && !undo_.front().first);
+  }
+}
+
+void Buffer::Apply_(const Edit_& edit, bool undo) {
+  std::string_view from(edit.bytes.data(), edit.removed);
+  std::string_view to = std::string_view(edit.bytes).substr(edit.removed);
+  if (undo) std::swap(from, to);
+  Erase_(edit.pos, edit.pos + from.size());
+  Insert_(edit.pos, to);
+}
+
 std::pair<int, int> Buffer::CurYX() const {
-  if (dirty_ || cur_ == buf_.begin()) return {0, 0};
-  return std::prev(cur_)->pos;
+  if (dirty_ || !cur_) return {0, 0};
+  return {Row_(cur_ - 1), Col_(cur_ - 1)};
 }
 
 int Buffer::Lines() const {
-  if (dirty_ || buf_.empty()) return 0;
-  return buf_.rbegin()->pos.first + 1;
+  if (dirty_ || !size()) return 0;
+  return rows_.size() + 1;
 }
 
 int Buffer::Columns() const {
-  if (dirty_ || buf_.empty()) return 0;
-  return maxcol_ + 1;
+  if (dirty_ || !size()) return 0;
+  return maxcols_.back() + 1;
 }
 
 bool Buffer::IsDirty() const {
@@ -29,186 +179,262 @@ bool Buffer::IsDirty() const {
 }
 
 std::string Buffer::ToString() const {
-  std::string str;
-  for (auto& i : buf_) str.push_back(i.ch);
+  std::string str(text_, 0, gap_begin_);
+  str.append(text_, gap_end_);
   return str;
 }
 
 void Buffer::MoveUp(int num) {
   if (dirty_) return;
+  coalesce_ = false;
   std::pair<int, int> now_pos = CurYX();
   if (now_pos.first < num) { // already on the first line
-    cur_ = buf_.begin();
+    cur_ = 0;
     return;
   }
-  auto prv = cur_;
-  for (--prv; prv->pos.first > now_pos.first - num;) cur_ = prv--;
-  while (prv != buf_.begin() && prv->pos.first == now_pos.first - num &&
-         (!prv->move || prv->pos.second > now_pos.second)) {
-    cur_ = prv--;
+  // The last position on the line not right of the current column
+  int row = now_pos.first - num;
+  size_t begin = RowBegin_(row);
+  for (size_t i = RowEnd_(row); i-- > begin;) {
+    if (Moves_(i) && Col_(i) <= now_pos.second) {
+      cur_ = i + 1;
+      return;
+    }
   }
-  if (!prv->move) cur_ = buf_.begin();
+  cur_ = row && begin < RowEnd_(row) ? begin + 1 : begin;
 }
 
 void Buffer::MoveDown(int num) {
   if (dirty_) return;
+  coalesce_ = false;
   std::pair<int, int> now_pos = CurYX();
   if (now_pos.first >= Lines() - num) { // already on the last line
-    cur_ = buf_.end();
+    cur_ = size();
     return;
   }
-  while (cur_->pos.first < now_pos.first + num) ++cur_;
-  while (cur_->pos.first == now_pos.first + num &&
-         cur_->pos.second < now_pos.second) {
-    ++cur_;
-  }
-  if (cur_->pos.first == now_pos.first + num) ++cur_;
+  // The first position on the line not left of the current column, or the
+  // end of the line
+  int row = now_pos.first + num;
+  size_t i = RowBegin_(row), end = RowEnd_(row);
+  while (i < end && Col_(i) < now_pos.second) ++i;
+  cur_ = i < end ? i + 1 : i;
 }
 
 void Buffer::MoveLeft() {
   if (dirty_) return;
-  if (cur_ == buf_.begin()) return;
-  if (--cur_ == buf_.begin()) return;
-  auto prv = std::prev(cur_);
-  while (prv != buf_.begin() && !prv->move) cur_ = prv--;
-  if (!prv->move) cur_ = buf_.begin();
+  coalesce_ = false;
+  if (!cur_) return;
+  --cur_;
+  while (cur_ && !Moves_(cur_ - 1)) --cur_;
 }
 
 void Buffer::MoveRight() {
   if (dirty_) return;
-  if (cur_ == buf_.end()) return;
-  while (!cur_->move) ++cur_;
-  ++cur_;
+  coalesce_ = false;
+  size_t end = size();
+  while (cur_ < end && !Moves_(cur_)) ++cur_;
+  if (cur_ < end) ++cur_;
 }
 
 void Buffer::MoveLineStart() {
   if (dirty_) return;
-  if (cur_ == buf_.begin()) return;
-  auto prv = std::prev(cur_);
-  while (prv != buf_.begin() && prv->ch != '\n') cur_ = prv--;
-  if (prv->ch != '\n') cur_ = buf_.begin();
+  coalesce_ = false;
+  while (cur_ && At_(cur_ - 1) != '\n') --cur_;
 }
 
 void Buffer::MoveLineEnd() {
   if (dirty_) return;
-  while (cur_ != buf_.end() && cur_->ch != '\n') ++cur_;
+  coalesce_ = false;
+  size_t end = size();
+  while (cur_ < end && At_(cur_) != '\n') ++cur_;
 }
 
 void Buffer::Backspace() {
-  if (cur_ == buf_.begin()) return;
-  auto start = std::prev(cur_);
-  if (dirty_) {
-    bool flag = false;
-    if (start == prev_.start || cur_ == prev_.start) flag = true;
-    while (start != buf_.begin() && 0x80 <= start->ch && start->ch < 0xc0) {
-      --start;
-      if (start == prev_.start) flag = true;
-    }
-    if (flag) {
-      // start <= prev_.start <= cur_
-      prev_.bytes.splice(prev_.start, buf_, start, prev_.start);
-      buf_.erase(prev_.start, cur_);
-      prev_.start = cur_;
-    } else {
-      // prev_.start < start < cur_
-      buf_.erase(start, cur_);
-    }
+  if (!cur_) return;
+  size_t start = cur_ - 1;
+  while (start && IsContinuation(At_(start))) --start;
+  if (!dirty_) BeginEvent_();
+  std::string_view removed = Erase_(start, cur_);
+  if (start < prev_.start) {
+    // [start, prev_.start) was in the text before the edit
+    prev_.removed.insert(0, removed.substr(0, prev_.start - start));
+    prev_.start = start;
+    prev_.inserted = 0;
   } else {
-    while (start != buf_.begin() && 0x80 <= start->ch && start->ch < 0xc0) {
-      --start;
-    }
-    prev_.bytes.splice(prev_.bytes.begin(), buf_, start, cur_);
-    prev_.start = cur_;
-    prev_.cur = prev_.bytes.end();
-    dirty_ = true;
+    prev_.inserted -= cur_ - start;
   }
+  cur_ = start;
 }
 
 void Buffer::Delete() {
-  if (cur_ == buf_.end()) return;
-  auto end = std::next(cur_);
-  while (end != buf_.end() && 0x80 <= end->ch && end->ch < 0xc0) ++end;
-  prev_.bytes.splice(prev_.bytes.end(), buf_, cur_, end);
-  if (!dirty_) {
-    prev_.start = cur_;
-    prev_.cur = prev_.bytes.begin();
-    dirty_ = true;
-  }
-  cur_ = end;
+  size_t size = this->size();
+  if (cur_ == size) return;
+  size_t end = cur_ + 1;
+  while (end < size && IsContinuation(At_(end))) ++end;
+  if (!dirty_) BeginEvent_();
+  prev_.removed += Erase_(cur_, end);
 }
 
 void Buffer::Insert(unsigned char ch) {
-  if (dirty_) {
-    buf_.emplace(cur_, ch);
-  } else {
-    prev_.start = buf_.emplace(cur_, ch);
-    prev_.cur = cur_;
-    dirty_ = true;
-  }
+  if (!dirty_) BeginEvent_();
+  char c = ch;
+  Insert_(cur_++, std::string_view(&c, 1));
+  prev_.inserted++;
 }
 
-void Buffer::SetMaxHeight(int maxheight, WINDOW* win) {
+bool Buffer::SetMaxHeight(int maxheight, WINDOW* win) {
   maxheight_ = maxheight;
-  PrintBufferTruncate(win);
+  drawn_ = 0;
+  return PrintBufferTruncate(win);
 }
 
-void Buffer::Undo() {
-  if (!dirty_) return;
-  dirty_ = false;
-  buf_.erase(prev_.start, cur_);
-  bool flag = prev_.bytes.empty();
-  buf_.splice(cur_, prev_.bytes);
-  if (!flag) cur_ = prev_.cur;
+bool Buffer::Undo() {
+  coalesce_ = false;
+  if (dirty_) {
+    Rollback_();
+    BeginEvent_();
+    return true;
+  }
+  if (undo_.empty()) return false;
+  do {
+    Apply_(undo_.back(), true);
+    cur_ = undo_.back().before;
+    redo_.push_back(std::move(undo_.back()));
+    undo_.pop_back();
+  } while (!redo_.back().first);
+  BeginEvent_();
+  return true;
+}
+
+bool Buffer::Redo() {
+  coalesce_ = false;
+  if (dirty_ || redo_.empty()) return false;
+  do {
+    Apply_(redo_.back(), false);
+    cur_ = redo_.back().after;
+    undo_.push_back(std::move(redo_.back()));
+    redo_.pop_back();
+  } while (!redo_.empty() && !redo_.back().first);
+  BeginEvent_();
+  return true;
+}
+
+void Buffer::ClearHistory() {
+  undo_.clear();
+  redo_.clear();
+  history_bytes_ = 0;
+  coalesce_ = false;
+}
+
+void Buffer::SetHistoryLimit(size_t edits, size_t bytes) {
+  max_edits_ = edits;
+  max_bytes_ = bytes;
+  Trim_();
 }
 
 void Buffer::Clear() {
-  buf_.clear();
-  cur_ = buf_.begin();
-  prev_.bytes.clear();
+  text_.clear();
+  gap_begin_ = gap_end_ = cur_ = 0;
+  cols_.clear();
+  rows_.clear();
+  maxcols_.clear();
+  drawn_ = 0;
+  prev_.removed.clear();
   dirty_ = false;
-}
-
-std::list<Buffer::Byte_>::iterator Buffer::PrintBuffer_(WINDOW* win) {
-  maxcol_ = 0;
-  wclear(win);
-  wmove(win, 0, 0);
-  std::pair<int, int> prev = {0, 0};
-  for (auto it = buf_.begin(); it != buf_.end(); ++it) {
-    waddch(win, it->ch);
-    getyx(win, it->pos.first, it->pos.second);
-    if (it->pos.first >= maxheight_) return it;
-    if (it->pos.second > maxcol_) maxcol_ = it->pos.second;
-    it->move = it->pos != prev;
-    prev = it->pos;
+  ClearHistory();
+}
+
+size_t Buffer::PrintBuffer_(WINDOW* win) {
+  size_t size = this->size();
+  // Draw again from the line of the first change, as a carriage return may
+  // have moved the cursor back over the line. Start after a whole character,
+  // so that the window has no partial character pending.
+  size_t start = std::min(drawn_, size);
+  int line = start ? Row_(start - 1) : 0;
+  start = RowBegin_(line);
+  while (start && !Moves_(start - 1)) --start;
+  int y = 0, x = 0;
+  if (start) {
+    y = Row_(start - 1);
+    x = Col_(start - 1);
+  }
+  rows_.erase(std::lower_bound(rows_.begin(), rows_.end(), start),
+              rows_.end());
+  maxcols_.resize(y);
+  int maxcol = y ? maxcols_.back() : 0;
+  for (size_t i = RowBegin_(y); i < start; i++) {
+    maxcol = std::max(maxcol, Col_(i));
   }
+  cols_.resize(size);
+  // Overflow is past maxheight, or past the window if it is smaller
+  int limit = std::min(maxheight_, getmaxy(win) - 1);
+  wmove(win, line, 0);
+  wclrtobot(win);
+  wmove(win, y, x);
+  for (size_t i = start; i < size; i++) {
+    int prevy = y, prevx = x;
+    if (CutShort_(i)) {
+      cols_[i] = ~x;
+      continue;
+    }
+    waddch(win, At_(i));
+    getyx(win, y, x);
+    if (y >= limit) {
+      drawn_ = i;
+      return i;
+    }
+    while ((int)rows_.size() < y) {
+      rows_.push_back(i);
+      maxcols_.push_back(maxcol);
+    }
+    maxcol = std::max(maxcol, x);
+    cols_[i] = y != prevy || x != prevx ? x : ~x;
+  }
+  maxcols_.push_back(maxcol);
+  drawn_ = size;
   SetCursor(win);
-  return buf_.end();
+  return size;
 }
 
-void Buffer::PrintBuffer(WINDOW* win) {
-  if (PrintBuffer_(win) != buf_.end()) { // rollback and reprint if overflow
-    Undo();
+bool Buffer::PrintBuffer(WINDOW* win) {
+  if (PrintBuffer_(win) != size()) { // rollback and reprint if overflow
+    if (getmaxy(win) <= maxheight_) return false;
+    Rollback_();
     PrintBuffer_(win);
+  } else {
+    Commit_();
   }
-  prev_.bytes.clear();
+  prev_.removed.clear();
   dirty_ = false;
+  return true;
 }
 
-void Buffer::PrintBufferTruncate(WINDOW* win) {
-  auto it = PrintBuffer_(win);
-  if (it != buf_.end()) { // truncate if overflow
+bool Buffer::PrintBufferTruncate(WINDOW* win) {
+  size_t it = PrintBuffer_(win);
+  if (it != size()) { // truncate if overflow
+    if (getmaxy(win) <= maxheight_) return false;
     // Truncate to whole UTF-8 character
-    while (it != buf_.begin() && 0x80 <= it->ch && it->ch < 0xc0) --it;
-    bool flag = cur_ == buf_.end();
-    for (auto i = it; i != buf_.end() && !flag; i++) {
-      if (cur_ == i) flag = true;
+    while (it && IsContinuation(At_(it))) --it;
+    size_t before = cur_;
+    if (Commit_()) { // undone along with the edit that caused it
+      cur_ = std::min(cur_, it);
+      Push_(it, Erase_(it, size()), "", before, cur_, undo_.empty());
+      coalesce_ = false;
+      Trim_();
+    } else {
+      // Truncated by a smaller maxheight: the earlier states no longer fit,
+      // and undoing this would only overflow and truncate again
+      Erase_(it, size());
+      cur_ = std::min(cur_, it);
+      ClearHistory();
     }
-    buf_.erase(it, buf_.end());
-    if (flag) cur_ = buf_.end();
     PrintBuffer_(win);
+  } else {
+    Commit_();
   }
-  prev_.bytes.clear();
+  prev_.removed.clear();
   dirty_ = false;
+  return true;
 }
 
 void Buffer::SetCursor(WINDOW* win) const {
@@ -248,11 +474,12 @@ Textbox::Textbox(int posy, int posx, int height, int width, bool writable,
       width_(width),
       maxheight_(maxheight < height ? height : maxheight),
       maxwidth_(maxwidth < width ? width : maxwidth),
+      padlines_(std::max(1, std::min(maxheight_, height_))),
       writable_(writable),
       multiline_(multiline),
       currow_(0),
       curcol_(0) {
-  pad_ = newpad(maxheight_ + 1, maxwidth_);
+  pad_ = newpad(padlines_ + 1, maxwidth_);
   Refresh();
 }
 
@@ -269,12 +496,11 @@ std::string Textbox::GetValue() const {
 }
 
 void Textbox::Redraw_(bool clr, bool truncate) {
-  if (clr) wclear(pad_);
-  if (truncate) {
-    buf_.PrintBuffer(pad_);
-  } else {
-    buf_.PrintBufferTruncate(pad_);
+  if (clr) {
+    wclear(pad_);
+    buf_.Invalidate();
   }
+  Print_(truncate);
   Refresh_();
 }
 
@@ -290,6 +516,43 @@ void Textbox::Refresh_(bool redraw) {
   Refresh(redraw);
 }
 
+void Textbox::GrowPad_(int lines) {
+  int newlines = padlines_;
+  while (newlines < lines) newlines *= 2;
+  newlines = std::min(newlines, maxheight_);
+  if (newlines <= padlines_) return;
+  WINDOW* pad = newpad(newlines + 1, maxwidth_);
+  copywin(pad_, pad, 0, 0, 0, 0, padlines_, maxwidth_ - 1, FALSE);
+  delwin(pad_);
+  pad_ = pad;
+  padlines_ = newlines;
+}
+
+void Textbox::Print_(bool rollback) {
+  // Only fails while padlines_ < maxheight_, so this ends
+  while (!(rollback ? buf_.PrintBuffer(pad_)
+                    : buf_.PrintBufferTruncate(pad_))) {
+    GrowPad_(padlines_ + 1);
+  }
+}
+
+bool Textbox::IsInput_(int ch) const {
+  return (multiline_ && ch == '\n') ||
+         (30 <= ch && ch < 256 && ch != kUndoKey && ch != kRedoKey);
+}
+
+void Textbox::InsertPending_() {
+  nodelay(stdscr, TRUE);
+  for (int ch; (ch = getch()) != ERR;) {
+    if (!IsInput_(ch)) {
+      ungetch(ch);
+      break;
+    }
+    buf_.Insert(ch);
+  }
+  nodelay(stdscr, FALSE);
+}
+
 void Textbox::Refresh(bool redraw) {
   pnoutrefresh(pad_, currow_, curcol_,
                posy_, posx_, posy_ + height_ - 1, posx_ + width_ - 1);
@@ -313,6 +576,7 @@ void Textbox::MoveWindow(int y, int x) {
 void Textbox::ResizeWindow(int height, int width) {
   height_ = height;
   width_ = width;
+  GrowPad_(height_);
   Refresh_(true);
 }
 
@@ -322,8 +586,9 @@ void Textbox::ResizeBuffer(int maxheight, int maxwidth) {
   maxheight_ = maxheight;
   maxwidth_ = maxwidth;
   delwin(pad_);
-  pad_ = newpad(maxheight_ + 1, maxwidth_);
-  buf_.SetMaxHeight(maxheight_, pad_);
+  padlines_ = std::max(1, std::min(maxheight_, height_));
+  pad_ = newpad(padlines_ + 1, maxwidth_);
+  if (!buf_.SetMaxHeight(maxheight_, pad_)) Print_(false);
   Refresh_(true);
 }
 
@@ -337,6 +602,11 @@ void Textbox::SetText(const std::string& str) {
   buf_.Clear();
   for (auto i : str) buf_.Insert(i);
   Redraw_(true, true);
+  buf_.ClearHistory();
+}
+
+void Textbox::SetHistoryLimit(size_t edits, size_t bytes) {
+  buf_.SetHistoryLimit(edits, bytes);
 }
 
 int Textbox::ProcessKey(int ch, bool input_redraw) {
@@ -350,12 +620,17 @@ int Textbox::ProcessKey(int ch, bool input_redraw) {
       case KEY_NPAGE: buf_.MoveDown(std::max(1, height_ - 1)); Refresh_(); break;
       case KEY_HOME: buf_.MoveLineStart(); Refresh_(); break;
       case KEY_END: buf_.MoveLineEnd(); Refresh_(); break;
-      case KEY_BACKSPACE: buf_.Backspace(); Redraw_(); break;
-      case KEY_DC: buf_.Delete(); Redraw_(); break;
+      case KEY_BACKSPACE: buf_.Backspace(); Redraw_(false); break;
+      case KEY_DC: buf_.Delete(); Redraw_(false); break;
+      case kUndoKey: if (buf_.Undo()) Redraw_(false); break;
+      case kRedoKey: if (buf_.Redo()) Redraw_(false); break;
       default: {
-        if ((multiline_ && ch == '\n') || (30 <= ch && ch < 256)) {
+        if (IsInput_(ch)) {
           buf_.Insert(ch);
-          if (input_redraw) Redraw_();
+          if (input_redraw) {
+            InsertPending_();
+            Redraw_(false);
+          }
         } else {
           return ch;
         }
@@ -497,6 +772,100 @@ int Menu::ProcessKey(int ch) {
   return 0;
 }
 
+// VirtualList
+
+VirtualList::VirtualList(size_t size, RowFunc row, int posy, int posx,
+                         int height, int width)
+    : win_(newwin(height, width, posy, posx)),
+      row_(std::move(row)),
+      size_(size),
+      top_(0),
+      current_(0),
+      posy_(posy),
+      posx_(posx),
+      height_(height),
+      width_(width) {
+  Redraw();
+  Refresh();
+}
+
+VirtualList::~VirtualList() {
+  wclear(win_);
+  wnoutrefresh(win_);
+  delwin(win_);
+}
+
+WINDOW* VirtualList::GetWin() {
+  return win_;
+}
+
+int VirtualList::GetValue() const {
+  if (!size_) return -1;
+  return current_;
+}
+
+void VirtualList::SetSize(size_t size) {
+  size_ = size;
+  top_ = current_ = 0;
+  Redraw();
+  Refresh();
+}
+
+void VirtualList::Redraw() {
+  werase(win_);
+  for (int i = 0; i < height_ && top_ + i < size_; i++) {
+    if (top_ + i == current_) wattron(win_, A_REVERSE);
+    mvwaddstr(win_, i, 0, row_(top_ + i, width_).c_str());
+    if (top_ + i == current_) wattroff(win_, A_REVERSE);
+  }
+}
+
+void VirtualList::Refresh() {
+  wnoutrefresh(win_);
+}
+
+void VirtualList::SetWindow(int posy, int posx, int height, int width) {
+  delwin(win_);
+  posy_ = posy;
+  posx_ = posx;
+  height_ = height;
+  width_ = width;
+  win_ = newwin(height_, width_, posy_, posx_);
+  // Keep the current row in view, and no blank rows below the last one
+  size_t max_top = size_ > (size_t)height_ ? size_ - height_ : 0;
+  top_ = std::min(top_, max_top);
+  if (current_ >= top_ + height_) top_ = current_ - height_ + 1;
+  Redraw();
+  Refresh();
+}
+
+void VirtualList::Scroll_(size_t current, size_t top) {
+  if (!size_) return;
+  current_ = std::min(current, size_ - 1);
+  size_t max_top = size_ > (size_t)height_ ? size_ - height_ : 0;
+  top_ = std::min(top, max_top);
+  if (current_ < top_) top_ = current_;
+  if (current_ >= top_ + height_) top_ = current_ - height_ + 1;
+  Redraw();
+  Refresh();
+}
+
+int VirtualList::ProcessKey(int ch) {
+  switch (ch) {
+    case KEY_DOWN: Scroll_(current_ + 1, top_); break;
+    case KEY_UP: if (current_) Scroll_(current_ - 1, top_); break;
+    case KEY_NPAGE: Scroll_(current_ + height_, top_ + height_); break;
+    case KEY_PPAGE:
+      Scroll_(current_ > (size_t)height_ ? current_ - height_ : 0,
+              top_ > (size_t)height_ ? top_ - height_ : 0);
+      break;
+    case KEY_HOME: Scroll_(0, 0); break;
+    case KEY_END: Scroll_(size_ - 1, size_); break;
+    default: return ch;
+  }
+  return 0;
+}
+
 // Checkbox
 
 CheckBox::CheckBox(int posy, int posx, int toggle, WINDOW* win, char on,
@@ -1,35 +1,87 @@
 #ifndef NCURSES_WIDGET_H_
 #define NCURSES_WIDGET_H_
 
-#include <list>
+#include <deque>
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <menu.h>
 #include <ncurses.h>
 
+// The text is kept in a gap buffer, and the layout of the last print in a
+// separate index, so that edits at the cursor and cursor movements do not
+// depend on the length of the text.
 class Buffer {
-  struct Byte_ {
-    unsigned char ch;
-    bool move;
-    std::pair<int, int> pos;
-    Byte_() {}
-    Byte_(unsigned char c) : ch(c), move(), pos() {}
-  };
-  std::list<Byte_> buf_;
-  std::list<Byte_>::iterator cur_;
+  // Text: text_[0, gap_begin_) followed by text_[gap_end_, end)
+  std::string text_;
+  size_t gap_begin_, gap_end_;
+  size_t cur_; // offset of the cursor in the text
+  // Layout of the last print. For each byte, the column of the cursor after
+  // printing it, or its complement if the cursor did not move (as after the
+  // leading bytes of a UTF-8 character). For each line but the first, the
+  // first byte after which the cursor is on that line or below, and the
+  // greatest column up to the end of each line.
+  std::vector<short> cols_;
+  std::vector<size_t> rows_;
+  std::vector<int> maxcols_;
+  // The layout and the window are up to date for [0, drawn_); printing
+  // starts from there
+  size_t drawn_;
   struct Event_ {
-    // To undo: erase [start, cur_), insert bytes to end, place cur_ to cur
-    // (cur points into bytes, while start, end points to buf_)
-    std::list<Byte_>::iterator start, cur;
-    std::list<Byte_> bytes;
-  } prev_; // leave it uninitialized (guarded by dirty)
+    // The edit since the last print: [start, start + inserted) of the text
+    // replaced `removed`, with the cursor at `cur` before the edit
+    size_t start, inserted, cur;
+    std::string removed;
+  } prev_; // guarded by dirty
+  // Edits printed so far, for Undo and Redo. An edit replaced `removed` bytes
+  // at `pos` by the rest of `bytes`. Edits are undone in groups, each
+  // starting at an edit marked `first`.
+  struct Edit_ {
+    uint32_t pos, removed;
+    uint32_t before, after; // cursor
+    bool first;
+    std::string bytes; // removed bytes, then the inserted ones
+  };
+  std::deque<Edit_> undo_, redo_;
+  size_t history_bytes_, max_edits_, max_bytes_;
+  bool coalesce_; // the next edit may be merged into the last group
   int maxheight_;
-  int maxcol_;
   bool dirty_;
-  std::list<Byte_>::iterator PrintBuffer_(WINDOW*);
+  unsigned char At_(size_t i) const {
+    return text_[i < gap_begin_ ? i : i + (gap_end_ - gap_begin_)];
+  }
+  int Row_(size_t i) const;
+  int Col_(size_t i) const { return cols_[i] < 0 ? ~cols_[i] : cols_[i]; }
+  bool Moves_(size_t i) const { return cols_[i] >= 0; }
+  size_t RowBegin_(int row) const { return row ? rows_[row - 1] : 0; }
+  size_t RowEnd_(int row) const {
+    return (size_t)row < rows_.size() ? rows_[row] : size();
+  }
+  // Whether byte i leads a UTF-8 character that is cut short. Such bytes are
+  // not drawn, as the window would keep them pending and join them with
+  // whatever is drawn next, wherever it is.
+  bool CutShort_(size_t i) const;
+  void MoveGap_(size_t pos);
+  void Insert_(size_t pos, std::string_view str);
+  // The removed bytes stay valid until the next change
+  std::string_view Erase_(size_t begin, size_t end);
+  void BeginEvent_();
+  // Drops the edit since the last print
+  void Rollback_();
+  // Moves the edit since the last print to the history, merging consecutive
+  // typing into one group. Returns false if there was none.
+  bool Commit_();
+  void Push_(size_t pos, std::string_view removed, std::string_view inserted,
+             size_t before, size_t after, bool first);
+  void Trim_();
+  void Apply_(const Edit_& edit, bool undo);
+  // Returns the offset of the first byte that does not fit, or size()
+  size_t PrintBuffer_(WINDOW*);
  public:
   Buffer(int maxheight);
-  size_t size() const { return buf_.size(); }
+  size_t size() const { return text_.size() - (gap_end_ - gap_begin_); }
   std::pair<int, int> CurYX() const;
   int Lines() const;
   int Columns() const;
@@ -52,29 +104,67 @@ class Buffer {
   void Delete();
   // `Insert` inserts one byte at a time.
   void Insert(unsigned char);
-  // Automatically calls PrintBufferTruncate
-  void SetMaxHeight(int, WINDOW*);
-  // Printing the buffer, undoing or clearing will clear the "dirty" state.
-  void Undo();
+  // Automatically calls PrintBufferTruncate, returning its result. Text cut
+  // off by a smaller maxheight clears the undo history.
+  bool SetMaxHeight(int, WINDOW*);
+  // Printing the buffer or clearing will clear the "dirty" state.
+  // `Undo` drops the edit since the last print if there is one; otherwise it
+  // reverts the last group of printed edits, where consecutive typing or
+  // deletion forms a group. `Redo` reapplies the groups undone since the
+  // last edit. Both leave the buffer dirty, and return false if there was
+  // nothing to do. Their cost depends on the size of the edits, not of the
+  // text.
+  bool Undo();
+  bool Redo();
+  // Forgets the edits, as after loading a new text
+  void ClearHistory();
+  // The history keeps at most `edits` edits, and `bytes` bytes of edited
+  // text, dropping the oldest groups beyond that (1000 edits and 1 MiB by
+  // default)
+  void SetHistoryLimit(size_t edits, size_t bytes);
   void Clear();
-  // The window must be at least one larger than maxheight,
-  // otherwise the overflow detection will not work!
-  void PrintBuffer(WINDOW*);
-  void PrintBufferTruncate(WINDOW*);
+  // The overflow is detected on the line after maxheight, so a window with
+  // fewer lines than maxheight + 1 may be too small for the text: then the
+  // print stops there and returns false, without rolling back or truncating,
+  // and must be done again on a larger window (with the lines drawn so far
+  // copied over, or after Invalidate).
+  // Only the part from the first change since the last print is laid out and
+  // drawn again, so the window must not be changed in between, unless
+  // Invalidate is called.
+  bool PrintBuffer(WINDOW*);
+  bool PrintBufferTruncate(WINDOW*);
   void SetCursor(WINDOW*) const;
+  // The next print draws the whole buffer, as on a cleared window
+  void Invalidate() { drawn_ = 0; }
 };
 
+// Keys of a writable Textbox to undo and redo edits: ^_ (also sent for ^/ by
+// most terminals) and ^R, as ^Z suspends the program
+const int kUndoKey = 31;
+const int kRedoKey = 18;
+
 class Textbox {
   WINDOW* pad_;
   Buffer buf_;
   int posy_, posx_;
   int height_, width_;
   int maxheight_, maxwidth_;
+  // Lines of pad_ besides the one for overflow detection; it starts at the
+  // window height and doubles as the text grows, up to maxheight_
+  int padlines_;
   // multiline only affects key processing
   bool writable_, multiline_;
   int currow_, curcol_;
   void Redraw_(bool clr = true, bool truncate = false);
   void Refresh_(bool redraw = false);
+  // Reallocates pad_ with at least `lines` lines, keeping its content
+  void GrowPad_(int lines);
+  // Prints the buffer, growing pad_ until it fits
+  void Print_(bool rollback);
+  bool IsInput_(int ch) const;
+  // Inserts the input keys already waiting in stdscr, up to the first other
+  // key, so that a paste is laid out and drawn once rather than per byte
+  void InsertPending_();
  public:
   Textbox(int posy, int posx, int height, int width, bool writable = true,
           bool multiline = true, int maxheight = 2000, int maxwidth = -1);
@@ -93,12 +183,18 @@ class Textbox {
   void MoveWindow(int y, int x);
   void ResizeWindow(int height, int width);
   // Shrinking the buffer may truncate the content; if the size is smaller than
-  // the window size, the window size will be shrinked to fit
+  // the window size, the window size will be shrinked to fit. The pad is
+  // reallocated to fit the window and the content.
   void ResizeBuffer(int maxheight, int maxwidth);
   void Clear();
+  // Replaces the text; the edits before cannot be undone
   void SetText(const std::string&);
+  // See Buffer::SetHistoryLimit
+  void SetHistoryLimit(size_t edits, size_t bytes);
   // To make non-ASCII code overflow detection work, one need to call ProcessKey
-  // with input_redraw = false on all but the last byte
+  // with input_redraw = false on all but the last byte. With input_redraw, the
+  // input already waiting is inserted along with the key, which covers the
+  // bytes of a character that arrive together.
   int ProcessKey(int, bool input_redraw = true);
 };
 
@@ -147,6 +243,38 @@ class Menu {
   int ProcessKey(int);
 };
 
+// A list like Menu whose rows are produced by `row(index, width)` when they
+// come into view. Only the visible rows are formatted and drawn, so scrolling
+// and resizing cost the same for any number of rows.
+class VirtualList {
+ public:
+  using RowFunc = std::function<std::string(size_t, int)>;
+ private:
+  WINDOW* win_;
+  RowFunc row_;
+  size_t size_, top_, current_;
+  int posy_, posx_;
+  int height_, width_;
+  void Scroll_(size_t current, size_t top);
+ public:
+  VirtualList(size_t size, RowFunc row, int posy, int posx, int height,
+              int width);
+  ~VirtualList();
+  VirtualList(const VirtualList&) = delete;
+  VirtualList& operator=(const VirtualList&) = delete;
+  WINDOW* GetWin();
+  // -1 if the list is empty
+  int GetValue() const;
+  // The rows have changed; selects the first one
+  void SetSize(size_t size);
+  void Redraw();
+  void Refresh();
+  // Moves and resizes the window at once, as the old size may not fit at the
+  // new position
+  void SetWindow(int posy, int posx, int height, int width);
+  int ProcessKey(int);
+};
+
 class CheckBox {
   WINDOW* win_;
   int toggle_, posy_, posx_;
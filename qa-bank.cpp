@@ -0,0 +1,180 @@
+#include "qa-bank.h"
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mapped-file.h"
+
+const char kBankMagic[8] = {'Q', 'A', 'B', 'A', 'N', 'K', '\0', '\2'};
+
+namespace {
+
+bool SourceStat(const std::string& csv, uint64_t& size, int64_t& mtime) {
+  struct stat st;
+  if (stat(csv.c_str(), &st) < 0) return false;
+  size = st.st_size;
+  mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+uint64_t HashContent(std::string_view str) { // FNV-1a
+  uint64_t ret = 0xcbf29ce484222325ULL;
+  for (unsigned char i : str) ret = (ret ^ i) * 0x100000001b3ULL;
+  return ret;
+}
+
+// Records the modification time of a source whose content is unchanged, so
+// that later opens need no hash again. On failure the next open just hashes.
+bool UpdateSourceMtime(const std::string& bank, int64_t mtime) {
+  int fd = open(bank.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  bool ok = pwrite(fd, &mtime, sizeof(mtime),
+                   offsetof(BankHeader, source_mtime)) == sizeof(mtime);
+  return !close(fd) && ok;
+}
+
+inline constexpr uint64_t Align(uint64_t x, uint64_t a) {
+  return (x + a - 1) / a * a;
+}
+
+// Offsets of the sections after the header
+struct BankLayout {
+  uint64_t ignore, entries, blob, end;
+  BankLayout(const BankHeader& header) {
+    ignore = Align(sizeof(BankHeader) + header.title_size, 4);
+    entries = Align(ignore + header.ignore_size * 4ULL, 8);
+    blob = entries + header.num_questions * sizeof(BankEntry);
+    end = blob + header.blob_size;
+  }
+
+  // Check every section against the file size without overflowing, so that
+  // a damaged or crafted bank cannot make the offsets wrap around
+  static bool Valid(const BankHeader& header, uint64_t size) {
+    if (header.title_size > size - sizeof(BankHeader)) return false;
+    uint64_t ignore = Align(sizeof(BankHeader) + header.title_size, 4);
+    if (ignore > size || header.ignore_size > (size - ignore) / 4) {
+      return false;
+    }
+    uint64_t entries = Align(ignore + header.ignore_size * 4ULL, 8);
+    if (entries > size ||
+        header.num_questions > (size - entries) / sizeof(BankEntry)) {
+      return false;
+    }
+    uint64_t blob = entries + header.num_questions * sizeof(BankEntry);
+    return header.blob_size == size - blob;
+  }
+};
+
+} // namespace
+
+std::string BankPath(const std::string& csv) {
+  return csv + ".qab";
+}
+
+bool CompileBank(const std::string& csv, const std::string& bank) {
+  BankHeader header = {};
+  memcpy(header.magic, kBankMagic, sizeof(kBankMagic));
+  // stat before reading, so that later modifications make the bank stale
+  if (!SourceStat(csv, header.source_size, header.source_mtime)) return false;
+  {
+    MappedFile src;
+    if (!src.Open(csv)) return false;
+    header.source_hash = HashContent(src.View());
+  }
+  QuestionSet qs = ReadCSV(csv);
+  if (qs.empty()) return false;
+
+  std::vector<uint32_t> ignore = qs.ignore_chars.CodePoints();
+  std::vector<BankEntry> entries;
+  entries.reserve(qs.size());
+  for (size_t i = 0; i < qs.size(); i++) {
+    Question q = qs.Get(i);
+    entries.push_back({header.blob_size, (uint32_t)q.description.size(),
+                       (uint32_t)q.answer.size(), q.case_sensitive,
+                       (uint32_t)q.answer_key.size()});
+    header.blob_size +=
+        q.description.size() + q.answer.size() + q.answer_key.size();
+  }
+  header.num_questions = entries.size();
+  header.flags = qs.default_case_sensitive ? kBankDefaultCaseSensitive : 0;
+  header.title_size = qs.title.size();
+  header.ignore_size = ignore.size();
+  BankLayout layout(header);
+
+  // Write to a temporary file and rename, so that a bank is always complete
+  std::string tmp = bank + ".tmp";
+  {
+    std::ofstream fout(tmp, std::ios::binary);
+    if (!fout.is_open()) return false;
+    auto Pad = [&fout](uint64_t pos) {
+      while ((uint64_t)fout.tellp() < pos) fout.put('\0');
+    };
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fout.write(qs.title.data(), qs.title.size());
+    Pad(layout.ignore);
+    fout.write(reinterpret_cast<const char*>(ignore.data()), ignore.size() * 4);
+    Pad(layout.entries);
+    fout.write(reinterpret_cast<const char*>(entries.data()),
+               entries.size() * sizeof(BankEntry));
+    for (size_t i = 0; i < qs.size(); i++) {
+      Question q = qs.Get(i);
+      fout.write(q.description.data(), q.description.size());
+      fout.write(q.answer.data(), q.answer.size());
+      fout.write(q.answer_key.data(), q.answer_key.size());
+    }
+    if (!fout.flush()) {
+      fout.close();
+      std::remove(tmp.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), bank.c_str())) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool OpenBank(const std::string& csv, QuestionSet& qs) {
+  auto file = std::make_unique<MappedFile>();
+  if (!file->Open(BankPath(csv), false)) return false;
+  if (file->size() < sizeof(BankHeader)) return false;
+  BankHeader header;
+  memcpy(&header, file->data(), sizeof(header));
+  if (memcmp(header.magic, kBankMagic, sizeof(kBankMagic))) return false;
+  if (!BankLayout::Valid(header, file->size())) return false;
+  BankLayout layout(header);
+
+  uint64_t size;
+  int64_t mtime;
+  if (!SourceStat(csv, size, mtime) || size != header.source_size) return false;
+  if (mtime != header.source_mtime) {
+    MappedFile src;
+    if (!src.Open(csv) || HashContent(src.View()) != header.source_hash) {
+      return false;
+    }
+    UpdateSourceMtime(BankPath(csv), mtime);
+  }
+
+  QuestionSet ret;
+  const char* base = file->data();
+  ret.title.assign(base + sizeof(BankHeader), header.title_size);
+  ret.default_case_sensitive = header.flags & kBankDefaultCaseSensitive;
+  for (uint32_t i = 0; i < header.ignore_size; i++) {
+    uint32_t ch;
+    memcpy(&ch, base + layout.ignore + i * 4ULL, 4);
+    ret.ignore_chars.Insert(ch);
+  }
+  ret.bank_entries_ = reinterpret_cast<const BankEntry*>(base + layout.entries);
+  ret.bank_blob_ = base + layout.blob;
+  ret.bank_size_ = header.num_questions;
+  ret.bank_blob_size_ = header.blob_size;
+  ret.file_ = std::move(file);
+  qs = std::move(ret);
+  return true;
+}
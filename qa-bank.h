@@ -0,0 +1,60 @@
+#ifndef QA_BANK_H_
+#define QA_BANK_H_
+
+#include <string>
+#include <cstdint>
+#include "qa-file.h"
+
+// Compiled question banks.
+// A bank is a CSV question file compiled into a binary image that can be
+// mapped and used directly, without parsing. It is a local cache of the CSV
+// file, so native byte order is used. Layout:
+//   BankHeader
+//   title (title_size bytes), padded to 4 bytes
+//   ignore_chars (ignore_size uint32_t code points, sorted), padded to 8 bytes
+//   BankEntry[num_questions]
+//   string blob (blob_size bytes)
+
+extern const char kBankMagic[8];
+
+// BankHeader::flags
+const uint32_t kBankDefaultCaseSensitive = 1;
+
+struct BankHeader {
+  char magic[8];
+  // The CSV file it is compiled from; used for staleness checks
+  uint64_t source_size;
+  int64_t source_mtime; // nanoseconds
+  uint64_t source_hash;
+  uint64_t num_questions;
+  uint64_t blob_size;
+  uint32_t flags;
+  uint32_t title_size;
+  uint32_t ignore_size;
+  uint32_t reserved;
+};
+
+struct BankEntry {
+  // Offset of the description in the blob; the answer and the answer key (see
+  // Question::answer_key) follow it
+  uint64_t offset;
+  uint32_t description_size, answer_size;
+  uint32_t case_sensitive;
+  uint32_t answer_key_size;
+};
+
+// Path of the compiled bank of a CSV file
+std::string BankPath(const std::string& csv);
+
+// Returns false if the CSV file is empty or cannot be read, or the bank cannot
+// be written.
+bool CompileBank(const std::string& csv, const std::string& bank);
+
+// Maps the bank of `csv` into `qs`. Returns false (and leaves `qs` unchanged)
+// if there is no valid bank or it is stale. A bank is fresh if the size and the
+// modification time of the CSV file match; if only the modification time
+// differs, the content hash is compared, and on a match the new modification
+// time is stored in the bank.
+bool OpenBank(const std::string& csv, QuestionSet& qs);
+
+#endif // QA_BANK_H_
@@ -1,132 +1,314 @@
 #include "qa-file.h"
 
-#include <cwctype>
-#include <locale>
-#include <codecvt>
-#include <fstream>
+#include <cstring>
+#include <filesystem>
 #include <algorithm>
-#include <nlohmann/json.hpp>
-#include "ncurses-utils.h"
+#include "utf8.h"
+#include "qa-bank.h"
+#include "csv-parser.h"
+#include "thread-pool.h"
 
-static inline std::wstring FromUTF8(const std::string& str) {
-  static std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
-  return conv.from_bytes(str);
+int Score(const Question& q, std::string_view user_ans,
+          const CharClass& ignore_chars) {
+  if (user_ans.empty()) return 0; // give up
+  return ignore_chars.FilteredEquals(user_ans, q.case_sensitive, q.answer_key);
 }
 
-int Score(const Question& q, const std::string& user_ans,
-          const std::unordered_set<wchar_t>& ignore_chars) {
-  if (user_ans.empty()) return 0; // give up
-  if (q.case_sensitive || ignore_chars.size()) {
-    std::wstring ans = FromUTF8(user_ans);
-    std::wstring user = FromUTF8(user_ans);
-    if (q.case_sensitive) {
-      for (auto& i : ans) i = std::towupper(i);
-      for (auto& i : user) i = std::towupper(i);
+namespace {
+
+// Files smaller than this are parsed sequentially
+const size_t kParallelMinSize = 8 << 20;
+const size_t kMinPieceSize = 1 << 20;
+// Files larger than this are opened lazily
+const size_t kLazyMinSize = 64 << 20;
+// Answers scored by one task of ScoreBatch
+const size_t kScoreBlockSize = 4096;
+
+// The answer key is not filled
+inline Question MakeQuestion(const std::vector<std::string_view>& line,
+                             bool default_case_sensitive) {
+  return {0, line.size() > 0 ? line[0] : std::string_view(),
+          line.size() > 1 ? line[1] : std::string_view(), {},
+          line.size() > 2 && line[2].size() ? line[2] == "1"
+                                            : default_case_sensitive,
+          {}};
+}
+
+// Reads the first row (title, default case sensitivity, ignored characters)
+// into `qs`. Returns where the questions start, or nullptr if the file is
+// empty.
+const char* ReadHeader(const MappedFile& file, QuestionSet& qs) {
+  // Find the end of the record first, so that the output is sized to it
+  // rather than to the whole file
+  CSVParser skipper(file.begin(), file.end());
+  if (!skipper.SkipRecord()) return nullptr;
+  StringArena out(skipper.Position() - file.begin());
+  CSVParser parser(file.begin(), skipper.Position(), out.data());
+  std::vector<std::string_view> line;
+  if (!parser.NextRecord(line)) return nullptr;
+  if (line.size() > 0) qs.title = line[0];
+  qs.default_case_sensitive = line.size() > 1 && line[1] == "1";
+  if (line.size() > 2) {
+    const char *p = line[2].data(), *end = p + line[2].size();
+    while (p != end) {
+      uint32_t ch = DecodeUTF8(p, end);
+      if (ch != kInvalidCodePoint) qs.ignore_chars.Insert(ch);
     }
-    if (ignore_chars.size()) {
-      auto FilterRule = [&ignore_chars](wchar_t i) { return !ignore_chars.count(i); };
-      ans.resize(std::stable_partition(ans.begin(), ans.end(), FilterRule) -
-                 ans.begin());
-      user.resize(std::stable_partition(user.begin(), user.end(), FilterRule) -
-                  user.begin());
+  }
+  return parser.Position();
+}
+
+// Splits the questions into pieces to be handled in parallel if the file is
+// large enough. `pool` is set to the pool to use.
+std::vector<const char*> SplitQuestions(const char* begin, const char* end,
+                                        ThreadPool*& pool) {
+  size_t size = end - begin;
+  if (size >= kParallelMinSize) {
+    if (!pool) pool = &DefaultThreadPool();
+    if (pool->Size() > 1) {
+      return SplitCSVRecords(begin, end,
+                             std::min(pool->Size() * 4, size / kMinPieceSize),
+                             *pool);
     }
-    return ans == user;
+  }
+  return {begin, end};
+}
+
+template <class Func>
+void ForEachPiece(ThreadPool* pool, size_t pieces, Func&& func) {
+  if (pieces == 1) {
+    func(0);
   } else {
-    return q.answer == user_ans;
+    pool->ParallelFor(pieces, func);
   }
 }
 
-static std::pair<bool, std::vector<std::string>> CSVLineToVector(std::ifstream& fin) {
-  std::vector<std::string> ans;
-  std::string current;
-  int in_quote = 0;
-  char ch;
-  while (fin.get(ch)) {
-    if (in_quote == 2) {
-      if (ch == ',') {
-        ans.emplace_back(std::move(current));
-        current.clear();
-      } else if (ch == '\"') {
-        in_quote = 1;
-        current.push_back(ch);
-      } else { // error
-        in_quote = 0;
-        current.push_back(ch);
-      }
-    } else if (in_quote == 1) {
-      if (ch == '\"') {
-        in_quote = 2;
-      } else {
-        current.push_back(ch);
-      }
+} // namespace
+
+struct QuestionSet::LazyRows {
+  // Start of each row, and the end of the file
+  std::vector<uint64_t> offsets;
+};
+
+struct Question::Storage {
+  StringArena fields;
+  std::string answer_key;
+};
+
+QuestionSet::QuestionSet() = default;
+QuestionSet::~QuestionSet() = default;
+QuestionSet::QuestionSet(QuestionSet&&) = default;
+QuestionSet& QuestionSet::operator=(QuestionSet&&) = default;
+
+uint64_t QuestionSet::Handle_(std::string_view str) const {
+  if (str.empty()) return 0;
+  if (str.data() >= file_->begin() && str.data() < file_->end()) {
+    return str.data() - file_->begin();
+  }
+  return (str.data() - arena_.data()) | kInArena;
+}
+
+std::string_view QuestionSet::View_(uint64_t handle, size_t size) const {
+  if (!size) return {};
+  if (handle & kInArena) return {arena_.data() + (handle ^ kInArena), size};
+  if (handle & kInKeys) return {keys_.data() + (handle ^ kInKeys), size};
+  return {file_->data() + handle, size};
+}
+
+size_t QuestionSet::size() const {
+  if (bank_entries_) return bank_size_;
+  if (lazy_) return lazy_->offsets.size() - 1;
+  return rows_.size();
+}
+
+Question QuestionSet::Get(size_t id) const {
+  if (lazy_) {
+    const char* base = file_->data();
+    const char *begin = base + lazy_->offsets[id],
+               *end = base + lazy_->offsets[id + 1];
+    // Only quotes and dropped bytes make fields that are not views into the
+    // file
+    bool plain = std::none_of(begin, end, [](char c) {
+      return c == '"' || c == '\xfe' || c == '\xff';
+    });
+    std::shared_ptr<Question::Storage> storage;
+    if (!plain) {
+      storage = std::make_shared<Question::Storage>();
+      storage->fields = StringArena(end - begin);
+    }
+    CSVParser parser(begin, end, storage ? storage->fields.data() : nullptr);
+    std::vector<std::string_view> line;
+    parser.NextRecord(line);
+    Question ret = MakeQuestion(line, default_case_sensitive);
+    ret.id = id;
+    std::string key;
+    ignore_chars.Filter(ret.answer, ret.case_sensitive, key);
+    if (key == ret.answer) {
+      ret.answer_key = ret.answer;
     } else {
-      switch (ch) {
-        case '\"': in_quote = 1; break;
-        case ',':
-          ans.emplace_back(std::move(current));
-          current.clear();
-          break;
-        case '\r': fin.get(); [[fallthrough]]; // should be '\n'
-        case '\n': ans.emplace_back(std::move(current)); return {true, ans};
-        case (char)0xfe: case (char)0xff: break; // Invalid UTF-8; ignore because of BOM
-        default: current.push_back(ch);
-      }
+      if (!storage) storage = std::make_shared<Question::Storage>();
+      storage->answer_key = std::move(key);
+      ret.answer_key = storage->answer_key;
     }
+    ret.storage = std::move(storage);
+    return ret;
   }
-  // File ends before EOL; technically invalid CSV
-  if (current.size()) ans.emplace_back(std::move(current));
-  if (ans.size()) return {true, ans};
-  return {false, ans}; // Valid: after last '\n'
+  if (bank_entries_) {
+    const BankEntry& entry = bank_entries_[id];
+    if (entry.offset > bank_blob_size_ ||
+        (uint64_t)entry.description_size + entry.answer_size +
+                entry.answer_key_size >
+            bank_blob_size_ - entry.offset) { // corrupted bank
+      return {id, {}, {}, {}, false, {}};
+    }
+    const char* ptr = bank_blob_ + entry.offset;
+    return {id, {ptr, entry.description_size},
+            {ptr + entry.description_size, entry.answer_size},
+            {ptr + entry.description_size + entry.answer_size,
+             entry.answer_key_size},
+            (bool)entry.case_sensitive, {}};
+  }
+  const Row& row = rows_[id];
+  return {id, View_(row.description, row.description_size),
+          View_(row.answer, row.answer_size),
+          View_(row.answer_key, row.answer_key_size), (bool)row.case_sensitive,
+          {}};
+}
+
+void QuestionSet::Clear() {
+  std::vector<Row>().swap(rows_);
+  bank_entries_ = nullptr;
+  bank_blob_ = nullptr;
+  bank_size_ = bank_blob_size_ = 0;
+  lazy_.reset();
+  arena_ = StringArena();
+  keys_ = StringArena();
+  file_.reset();
 }
 
-QuestionSet ReadCSV(const std::string& filename) {
-  std::ifstream fin(filename);
-  if (!fin.is_open()) return {};
-  auto line = CSVLineToVector(fin);
-  if (!line.first) return {};
+QuestionSet ReadCSV(const std::string& filename, ThreadPool* pool) {
+  auto file = std::make_unique<MappedFile>();
+  if (!file->Open(filename)) return {};
   QuestionSet ret;
-  if (line.second.size() > 0) ret.title = line.second[0];
-  bool default_case_sensitive = line.second.size() > 1 && line.second[1] == "1";
-  if (line.second.size() > 2) {
-    std::wstring str = FromUTF8(line.second[2]);
-    for (auto& i : str) ret.ignore_chars.insert(i);
+  const char* start = ReadHeader(*file, ret);
+  if (!start) return {};
+  ret.file_ = std::move(file);
+  const char* end = ret.file_->end();
+
+  // Parse the questions in pieces, each with its own parser. Every piece
+  // decodes into its own part of the arena, which has the size of the input.
+  // The answer keys are collected per piece, and moved to keys_ afterwards.
+  std::vector<const char*> cuts = SplitQuestions(start, end, pool);
+  size_t pieces = cuts.size() - 1;
+  ret.arena_ = StringArena(end - start);
+  std::vector<std::vector<QuestionSet::Row>> parts(pieces);
+  std::vector<std::string> keys(pieces);
+  ForEachPiece(pool, pieces, [&](size_t i) {
+    CSVParser parser(cuts[i], cuts[i + 1],
+                     ret.arena_.data() + (cuts[i] - start));
+    std::vector<std::string_view> line;
+    parts[i].reserve((cuts[i + 1] - cuts[i]) / 64);
+    while (parser.NextRecord(line)) {
+      Question q = MakeQuestion(line, ret.default_case_sensitive);
+      uint64_t answer = ret.Handle_(q.answer), answer_key = answer;
+      size_t pos = keys[i].size();
+      ret.ignore_chars.Filter(q.answer, q.case_sensitive, keys[i]);
+      size_t key_size = keys[i].size() - pos;
+      if (std::string_view(keys[i]).substr(pos) == q.answer) {
+        keys[i].resize(pos);
+      } else {
+        answer_key = pos | QuestionSet::kInKeys; // relative to the piece
+      }
+      parts[i].push_back({ret.Handle_(q.description), answer, answer_key,
+                          (uint32_t)q.description.size(), (uint32_t)key_size,
+                          (uint32_t)q.answer.size(), q.case_sensitive});
+    }
+  });
+  size_t num = 0, key_size = 0;
+  for (size_t i = 0; i < pieces; i++) {
+    num += parts[i].size();
+    key_size += keys[i].size();
   }
-  for (size_t i = 0; line = CSVLineToVector(fin), line.first; i++) {
-    ret.questions.push_back({i, line.second.size() > 0 ? line.second[0] : "",
-                             line.second.size() > 1 ? line.second[1] : "",
-                             line.second.size() > 2 && line.second[2].size()
-                                 ? line.second[2] == "1"
-                                 : default_case_sensitive});
+  ret.keys_ = StringArena(key_size);
+  for (size_t i = 0, base = 0; i < pieces; base += keys[i].size(), i++) {
+    if (keys[i].empty()) continue;
+    memcpy(ret.keys_.data() + base, keys[i].data(), keys[i].size());
+    std::string().swap(keys[i]);
+    for (auto& row : parts[i]) {
+      if (row.answer_key & QuestionSet::kInKeys) row.answer_key += base;
+    }
+  }
+  if (pieces == 1) {
+    ret.rows_ = std::move(parts[0]);
+  } else {
+    ret.rows_.reserve(num);
+    for (auto& i : parts) {
+      ret.rows_.insert(ret.rows_.end(), i.begin(), i.end());
+      std::vector<QuestionSet::Row>().swap(i);
+    }
   }
   return ret;
 }
 
-const std::string kHistoryHeader =
-    "Score  Tot.Ques.  Elapsed(s)     Date/Time      ";
-  // 0    |    ^10  |    ^20  |    ^30  |    ^40  |  v48
-  //    88         99       2.555 2020-08-14 01:02:03
+QuestionSet IndexCSV(const std::string& filename, ThreadPool* pool) {
+  auto file = std::make_unique<MappedFile>();
+  if (!file->Open(filename)) return {};
+  QuestionSet ret;
+  const char* start = ReadHeader(*file, ret);
+  if (!start) return {};
 
-std::string TestResult::GetMenuText(int tot_width) const {
-  int name_width = tot_width - kHistoryHeader.size();
-  size_t num = PrefixFit(file, name_width);
-  if (num < file.size()) {
-    while (num && 0x80 <= (unsigned char)file[num] &&
-           (unsigned char)file[num] < 0xc0) {
-      --num;
+  std::vector<const char*> cuts = SplitQuestions(start, file->end(), pool);
+  size_t pieces = cuts.size() - 1;
+  std::vector<std::vector<uint64_t>> parts(pieces);
+  ForEachPiece(pool, pieces, [&](size_t i) {
+    CSVParser parser(cuts[i], cuts[i + 1]);
+    for (const char* p = cuts[i]; parser.SkipRecord(); p = parser.Position()) {
+      parts[i].push_back(p - file->begin());
     }
+  });
+  ret.lazy_ = std::make_unique<QuestionSet::LazyRows>();
+  auto& offsets = ret.lazy_->offsets;
+  size_t num = 0;
+  for (auto& i : parts) num += i.size();
+  offsets.reserve(num + 1);
+  for (auto& i : parts) {
+    offsets.insert(offsets.end(), i.begin(), i.end());
+    std::vector<uint64_t>().swap(i);
   }
-  std::string display_file = file.substr(0, num);
-  size_t width = StringWidth(display_file);
-  char buf[50], datebuf[22];
-  strftime(datebuf, sizeof(datebuf), "%Y-%m-%d %H:%M:%S", localtime(&finish));
-  snprintf(buf, sizeof(buf), "%5d%11d%12.3lf%20s", score, (int)ord.size(),
-           elapsed, datebuf);
-  return display_file + std::string(name_width - width, ' ') + buf;
+  offsets.push_back(file->size());
+  file->Release();
+  ret.file_ = std::move(file);
+  return ret;
+}
+
+std::vector<int> ScoreBatch(const QuestionSet& qs,
+                            const std::vector<UserAnswer>& answers,
+                            ThreadPool* pool) {
+  std::vector<int> ret(answers.size());
+  size_t blocks = (answers.size() + kScoreBlockSize - 1) / kScoreBlockSize;
+  if (!blocks) return ret;
+  if (blocks > 1 && !pool) pool = &DefaultThreadPool();
+  ForEachPiece(pool, blocks, [&](size_t i) {
+    size_t end = std::min(answers.size(), (i + 1) * kScoreBlockSize);
+    for (size_t j = i * kScoreBlockSize; j < end; j++) {
+      ret[j] = Score(qs.Get(answers[j].id), answers[j].ans, qs.ignore_chars);
+    }
+  });
+  return ret;
+}
+
+QuestionSet OpenQuestionSet(const std::string& filename) {
+  QuestionSet ret;
+  if (OpenBank(filename, ret)) return ret;
+  std::error_code ec;
+  auto size = std::filesystem::file_size(filename, ec);
+  if (!ec && size >= kLazyMinSize) return IndexCSV(filename);
+  return ReadCSV(filename);
 }
 
 std::string TestResult::GetSummary(bool full) const {
   std::string ret;
-  if (full) ret = "Question file: " + file + '\n';
+  if (full) ret = "Question file: " + file.str() + '\n';
   char buf[100];
   snprintf(buf, sizeof(buf), "Score: %d/%d\n", score, fullmark);
   ret += buf;
@@ -143,75 +325,37 @@ std::string TestResult::GetSummary(bool full) const {
 std::string TestResult::GetReview(const QuestionSet& qs, bool full) const {
   std::string ret = GetSummary(full);
   ret += "\nReview:\n";
-  std::unordered_set<size_t> wa_ids;
-  for (auto& i : wa) {
+  IdSet wa_ids;
+  for (auto i : wa) {
     if (unsure.count(i.id)) {
       ret += "[incorrect, unsure] ";
     } else {
       ret += "[incorrect] ";
     }
-    auto& q = qs.questions[i.id];
-    ret += "Question: " + q.description + ", answer: " + q.answer;
+    Question q = qs.Get(i.id);
+    ret += "Question: ";
+    ret += q.description;
+    ret += ", answer: ";
+    ret += q.answer;
     if (i.ans.empty()) {
       ret += ", you gave up this question (Q";
     } else {
-      ret += ", your answer: " + i.ans + " (Q";
+      ret += ", your answer: ";
+      ret += i.ans;
+      ret += " (Q";
     }
     ret += std::to_string(i.id + 1) + ")\n";
     wa_ids.insert(i.id);
   }
   for (auto& id : unsure) {
     if (wa_ids.count(id)) continue;
-    auto& q = qs.questions[id];
-    ret += "[unsure] Question: " + q.description + ", answer: " + q.answer +
-           " (Q" + std::to_string(id + 1) + ")\n";
+    Question q = qs.Get(id);
+    ret += "[unsure] Question: ";
+    ret += q.description;
+    ret += ", answer: ";
+    ret += q.answer;
+    ret += " (Q" + std::to_string(id + 1) + ")\n";
   }
   if (!full) ret.pop_back();
   return ret;
 }
-
-bool ExportHistory(const std::string& filename,
-                   const std::deque<TestResult>& hist) {
-  std::ofstream fout(filename);
-  if (!fout.is_open()) return false;
-  using JSON = nlohmann::json;
-  JSON ret;
-  for (auto& i : hist) {
-    JSON entry;
-    entry["file"] = i.file;
-    entry["order"] = i.ord;
-    entry["unsure"] = i.unsure;
-    for (auto& j : i.wa) entry["wa"].push_back(JSON{j.id, j.ans});
-    entry["time"] = i.finish;
-    entry["elapsed"] = i.elapsed;
-    entry["score"] = i.score;
-    entry["fullmark"] = i.fullmark;
-    ret.push_back(std::move(entry));
-  }
-  fout << ret;
-  return true;
-}
-
-std::deque<TestResult> ReadHistory(const std::string& filename) {
-  std::ifstream fin(filename);
-  if (!fin.is_open()) return {};
-  using JSON = nlohmann::json;
-  JSON json;
-  fin >> json;
-  std::deque<TestResult> ret;
-  for (auto& i : json) {
-    TestResult tr;
-    tr.file = i["file"].get<std::string>();
-    for (auto& j : i["order"]) tr.ord.push_back(j);
-    for (auto& j : i["unsure"]) tr.unsure.insert(j.get<size_t>());
-    tr.finish = i["time"];
-    tr.elapsed = i["elapsed"];
-    tr.score = i["score"];
-    tr.fullmark = i["fullmark"];
-    for (auto& j : i["wa"]) {
-      tr.wa.push_back({j[0].get<size_t>(), j[1].get<std::string>()});
-    }
-    ret.push_back(std::move(tr));
-  }
-  return ret;
-}
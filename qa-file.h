@@ -1,49 +1,192 @@
 #ifndef QA_FILE_H_
 #define QA_FILE_H_
 
-#include <deque>
+#include <memory>
+#include <cstdint>
 #include <string>
 #include <vector>
-#include <unordered_set>
+#include <string_view>
+#include <algorithm>
+#include "char-class.h"
+#include "interned-string.h"
+#include "mapped-file.h"
+#include "string-arena.h"
 
 struct Question {
   size_t id;
-  std::string description, answer;
+  // Views into the storage of the QuestionSet the question belongs to
+  std::string_view description, answer;
+  // The answer in the form user answers are compared in: case folded if
+  // `case_sensitive` is set (which means case-insensitive, as A2 in the CSV
+  // file), ignored characters removed
+  std::string_view answer_key;
   bool case_sensitive;
+  // Fields of a lazily parsed question that are not views into the file,
+  // shared by the copies of the question
+  struct Storage;
+  std::shared_ptr<const Storage> storage;
 };
 
-int Score(const Question&, const std::string& user_ans,
-          const std::unordered_set<wchar_t>& ignore_chars);
+// The user answer is normalized while being compared with the answer key
+int Score(const Question&, std::string_view user_ans,
+          const CharClass& ignore_chars);
 
-struct QuestionSet {
+struct BankEntry;
+class ThreadPool;
+class QuestionSet;
+
+struct UserAnswer {
+  size_t id;
+  std::string_view ans; // empty string: give up
+};
+
+// Scores each answer against question `id` of the set, in parallel on `pool`
+// (DefaultThreadPool() if null) if there are many. The scores are in the
+// order of `answers`.
+std::vector<int> ScoreBatch(const QuestionSet&,
+                            const std::vector<UserAnswer>& answers,
+                            ThreadPool* pool = nullptr);
+
+class QuestionSet {
+  // Questions parsed from a CSV file, in compact form: the strings are
+  // (offset, size) handles into the mapped file, or into the arena if
+  // kInArena is set in the offset.
+  static const uint64_t kInArena = 1ULL << 63;
+  // kInKeys marks a handle into the answer keys.
+  static const uint64_t kInKeys = 1ULL << 62;
+  struct Row {
+    uint64_t description, answer, answer_key;
+    uint32_t description_size, answer_key_size;
+    uint32_t answer_size : 31, case_sensitive : 1;
+  };
+  std::vector<Row> rows_;
+  // Questions of a compiled bank (see qa-bank.h), kept in the mapping
+  const BankEntry* bank_entries_ = nullptr;
+  const char* bank_blob_ = nullptr;
+  size_t bank_size_ = 0, bank_blob_size_ = 0;
+  // Lazily parsed CSV file: only the offsets of the rows in the mapping are
+  // kept, and questions are parsed on access
+  struct LazyRows;
+  std::unique_ptr<LazyRows> lazy_;
+  // Storage of the questions: the mapped file, the arena for the fields that
+  // cannot be represented as a view into it, and the answer keys that differ
+  // from the answers
+  std::unique_ptr<MappedFile> file_;
+  StringArena arena_, keys_;
+  uint64_t Handle_(std::string_view) const;
+  std::string_view View_(uint64_t handle, size_t size) const;
+  friend QuestionSet ReadCSV(const std::string& filename, ThreadPool* pool);
+  friend QuestionSet IndexCSV(const std::string& filename, ThreadPool* pool);
+  friend bool OpenBank(const std::string& csv, QuestionSet&);
+ public:
   std::string title;
-  std::unordered_set<wchar_t> ignore_chars;
-  std::vector<Question> questions;
+  bool default_case_sensitive = false;
+  CharClass ignore_chars;
+  // Moving keeps the views valid, so copying is disabled.
+  QuestionSet();
+  ~QuestionSet();
+  QuestionSet(QuestionSet&&);
+  QuestionSet& operator=(QuestionSet&&);
+  size_t size() const;
+  bool empty() const { return !size(); }
+  // The returned question stays valid until the set is cleared or destroyed.
+  // In lazy mode, nothing is kept per question: it is parsed again on each
+  // call, and the fields that need decoding live as long as the question (or
+  // a copy of it). Thread-safe.
+  Question Get(size_t id) const;
+  // Releases all storage at once
+  void Clear();
 };
 
-QuestionSet ReadCSV(const std::string& filename);
+// Large files are parsed in parallel on `pool` (DefaultThreadPool() if null)
+QuestionSet ReadCSV(const std::string& filename, ThreadPool* pool = nullptr);
+// Lazy mode: only finds where the rows are, and parses a question when it is
+// accessed. The pages of the file are released after indexing, so memory use
+// does not depend on the size of the file (except 8 bytes per question).
+QuestionSet IndexCSV(const std::string& filename, ThreadPool* pool = nullptr);
+// Opens the compiled bank of the file if it is up to date, and reads the CSV
+// file otherwise (lazily if it is large).
+QuestionSet OpenQuestionSet(const std::string& filename);
 
-extern const std::string kHistoryHeader;
+// Question ids of a test result in increasing order, as a set
+class IdSet {
+  std::vector<uint32_t> ids_;
+ public:
+  using const_iterator = std::vector<uint32_t>::const_iterator;
+  void insert(size_t id) {
+    auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+    if (it == ids_.end() || *it != id) ids_.insert(it, id);
+  }
+  size_t count(size_t id) const {
+    return std::binary_search(ids_.begin(), ids_.end(), id);
+  }
+  void clear() { ids_.clear(); }
+  void reserve(size_t n) { ids_.reserve(n); }
+  size_t size() const { return ids_.size(); }
+  bool empty() const { return ids_.empty(); }
+  const_iterator begin() const { return ids_.begin(); }
+  const_iterator end() const { return ids_.end(); }
+};
 
-class TestResult {
+// Wrong answers of a test result. The answers are kept in one string.
+class WrongAnswerList {
+  struct Entry_ {
+    uint32_t id, offset, size;
+  };
+  std::vector<Entry_> entries_;
+  std::string pool_;
  public:
-  std::string file;
   struct WrongAnswer {
     size_t id;
-    std::string ans; // empty string: give up
+    std::string_view ans; // empty string: give up
   };
-  std::vector<size_t> ord;
-  std::unordered_set<size_t> unsure;
-  std::vector<WrongAnswer> wa;
+  class const_iterator {
+    const WrongAnswerList* list_;
+    size_t pos_;
+   public:
+    const_iterator(const WrongAnswerList* list, size_t pos)
+        : list_(list), pos_(pos) {}
+    WrongAnswer operator*() const { return (*list_)[pos_]; }
+    const_iterator& operator++() {
+      pos_++;
+      return *this;
+    }
+    bool operator!=(const const_iterator& x) const { return pos_ != x.pos_; }
+  };
+  void push_back(const WrongAnswer& x) {
+    entries_.push_back({(uint32_t)x.id, (uint32_t)pool_.size(),
+                        (uint32_t)x.ans.size()});
+    pool_ += x.ans;
+  }
+  WrongAnswer operator[](size_t i) const {
+    const Entry_& entry = entries_[i];
+    return {entry.id, std::string_view(pool_).substr(entry.offset, entry.size)};
+  }
+  void clear() {
+    entries_.clear();
+    pool_.clear();
+  }
+  void reserve(size_t n) { entries_.reserve(n); }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  const_iterator begin() const { return {this, 0}; }
+  const_iterator end() const { return {this, entries_.size()}; }
+};
+
+// Question ids are 32-bit and the file path is interned, so that a large
+// history is cheap to keep in memory
+class TestResult {
+ public:
+  InternedString file;
+  using WrongAnswer = WrongAnswerList::WrongAnswer;
+  std::vector<uint32_t> ord;
+  IdSet unsure;
+  WrongAnswerList wa;
   time_t finish;
   double elapsed;
   int score, fullmark;
-  std::string GetMenuText(int width) const;
   std::string GetSummary(bool full) const;
   std::string GetReview(const QuestionSet&, bool full) const;
 };
 
-bool ExportHistory(const std::string& filename, const std::deque<TestResult>&);
-std::deque<TestResult> ReadHistory(const std::string& filename);
-
 #endif // QA_FILE_H_
@@ -0,0 +1,1195 @@
+#include "qa-history.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <iterator>
+#include <unordered_set>
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <nlohmann/json.hpp>
+#include "mapped-file.h"
+#include "ncurses-utils.h"
+
+const char kHistoryMagic[8] = {'Q', 'A', 'H', 'I', 'S', 'T', '\0', '\2'};
+
+const std::string kHistoryHeader =
+    "Score  Tot.Ques.  Elapsed(s)     Date/Time      ";
+  // 0    |    ^10  |    ^20  |    ^30  |    ^40  |  v48
+  //    88         99       2.555 2020-08-14 01:02:03
+
+namespace {
+
+using JSON = nlohmann::json;
+
+// Input iterator that records how far the parser has read, to locate errors
+class TrackingIterator {
+  const char* p_;
+  const char** pos_;
+ public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = char;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const char*;
+  using reference = const char&;
+  TrackingIterator(const char* p, const char** pos) : p_(p), pos_(pos) {}
+  reference operator*() const { return *p_; }
+  TrackingIterator& operator++() {
+    *pos_ = ++p_;
+    return *this;
+  }
+  bool operator==(const TrackingIterator& x) const { return p_ == x.p_; }
+  bool operator!=(const TrackingIterator& x) const { return p_ != x.p_; }
+};
+
+// SAX handler building the results of a JSON history directly, without a
+// DOM. Records are objects at depth `record_depth`: 1 for one object per
+// line, 2 for a single array.
+class HistorySAX {
+  enum Field {
+    kFile, kOrder, kUnsure, kWA, kTime, kElapsed, kScore, kFullmark, kUnknown
+  };
+  static const int kRequired = 1 << kFile | 1 << kTime | 1 << kElapsed |
+                               1 << kScore | 1 << kFullmark;
+  std::vector<TestResult>& out_;
+  int record_depth_, depth_ = 0;
+  Field field_ = kUnknown;
+  int seen_ = 0; // fields present in the current record
+  size_t wa_pos_ = 0; // position in the current (id, answer) pair
+  size_t wa_id_ = 0;
+
+  bool Error_(const std::string& msg) {
+    error = msg;
+    return false;
+  }
+  size_t complete_ = 0; // records parsed completely
+  TestResult& Current_() { return out_.back(); }
+  // A value inside the field (at depth_ - record_depth_ arrays deep), or the
+  // field itself at depth 0
+  bool Integer_(int64_t x) {
+    int level = depth_ - record_depth_;
+    if (field_ == kUnknown) return level >= 0 || Error_("unexpected number");
+    if (level == 0) {
+      switch (field_) {
+        case kTime: Current_().finish = x; break;
+        case kElapsed: Current_().elapsed = x; break;
+        case kScore: Current_().score = x; break;
+        case kFullmark: Current_().fullmark = x; break;
+        default: return Error_("unexpected number");
+      }
+      seen_ |= 1 << field_;
+      return true;
+    }
+    if (x < 0) return Error_("negative question id");
+    if (x > UINT32_MAX) return Error_("question id out of range");
+    if (level == 1 && field_ == kOrder) {
+      Current_().ord.push_back(x);
+    } else if (level == 1 && field_ == kUnsure) {
+      Current_().unsure.insert(x);
+    } else if (level == 2 && field_ == kWA && wa_pos_++ == 0) {
+      wa_id_ = x;
+    } else {
+      return Error_("unexpected number");
+    }
+    return true;
+  }
+ public:
+  std::string error;
+  HistorySAX(std::vector<TestResult>& out, int record_depth)
+      : out_(out), record_depth_(record_depth) {}
+  bool Finished() const { return depth_ == 0; }
+  size_t Complete() const { return complete_; }
+
+  bool null() {
+    // "wa": null, or an empty history of older versions
+    if (depth_ == record_depth_ && field_ == kWA) return true;
+    if (depth_ == 0 && record_depth_ == 2) return true;
+    return (field_ == kUnknown && depth_ >= record_depth_) ||
+           Error_("unexpected null");
+  }
+  bool boolean(bool) {
+    return (field_ == kUnknown && depth_ >= record_depth_) ||
+           Error_("unexpected boolean");
+  }
+  bool number_integer(int64_t x) { return Integer_(x); }
+  bool number_unsigned(uint64_t x) {
+    if (x > INT64_MAX) return Error_("number out of range");
+    return Integer_(x);
+  }
+  bool number_float(double x, const std::string&) {
+    if (depth_ == record_depth_ && field_ == kElapsed) {
+      Current_().elapsed = x;
+      seen_ |= 1 << kElapsed;
+      return true;
+    }
+    return (field_ == kUnknown && depth_ >= record_depth_) ||
+           Error_("unexpected number");
+  }
+  bool string(std::string& str) {
+    int level = depth_ - record_depth_;
+    if (level == 0 && field_ == kFile) {
+      Current_().file = std::move(str);
+      seen_ |= 1 << kFile;
+    } else if (level == 2 && field_ == kWA && wa_pos_++ == 1) {
+      Current_().wa.push_back({wa_id_, str});
+    } else if (field_ != kUnknown || level < 0) {
+      return Error_("unexpected string");
+    }
+    return true;
+  }
+  bool binary(std::vector<uint8_t>&) { return Error_("unexpected binary"); }
+  bool start_object(size_t) {
+    if (depth_ + 1 == record_depth_) {
+      out_.emplace_back();
+      seen_ = 0;
+      field_ = kUnknown;
+    } else if (depth_ < record_depth_ || field_ != kUnknown) {
+      return Error_("unexpected object");
+    }
+    depth_++;
+    return true;
+  }
+  bool key(std::string& key) {
+    if (depth_ != record_depth_) return true; // inside an unknown field
+    static const std::pair<const char*, Field> kKeys[] = {
+        {"file", kFile}, {"order", kOrder}, {"unsure", kUnsure},
+        {"wa", kWA}, {"time", kTime}, {"elapsed", kElapsed},
+        {"score", kScore}, {"fullmark", kFullmark}};
+    field_ = kUnknown;
+    for (auto& i : kKeys) {
+      if (key == i.first) field_ = i.second;
+    }
+    return true;
+  }
+  bool end_object() {
+    if (--depth_ + 1 == record_depth_) {
+      if ((seen_ & kRequired) != kRequired) return Error_("missing field");
+      field_ = kUnknown;
+      complete_++;
+    }
+    return true;
+  }
+  bool start_array(size_t) {
+    int level = depth_ - record_depth_;
+    if (depth_ == 0 && record_depth_ == 2) {
+      // the array of results
+    } else if (level == 1 && field_ == kWA) {
+      wa_pos_ = 0;
+    } else if (level == 0 &&
+               (field_ == kOrder || field_ == kUnsure || field_ == kWA)) {
+      seen_ |= 1 << field_;
+    } else if (level < 0 || field_ != kUnknown) {
+      return Error_("unexpected array");
+    }
+    depth_++;
+    return true;
+  }
+  bool end_array() {
+    if (--depth_ - record_depth_ == 1 && field_ == kWA && wa_pos_ != 2) {
+      return Error_("wrong answer should be [id, answer]");
+    }
+    return true;
+  }
+  bool parse_error(size_t, const std::string&,
+                   const nlohmann::detail::exception& ex) {
+    return Error_(ex.what());
+  }
+};
+
+// Parses [begin, end) with `sax`; throws with the byte offset in `content`
+// where parsing stopped on errors
+void ParseJSON(std::string_view content, size_t begin, size_t end,
+               HistorySAX& sax) {
+  const char* base = content.data();
+  const char* pos = base + begin;
+  bool ok = JSON::sax_parse(TrackingIterator(base + begin, &pos),
+                            TrackingIterator(base + end, &pos), &sax);
+  if (ok && !sax.Finished()) ok = false, sax.error = "unexpected end";
+  if (!ok) {
+    throw std::runtime_error("byte " + std::to_string(pos - base) + ": " +
+                             sax.error);
+  }
+}
+
+// JSON history of older versions: either a single array (newest first) or one
+// object per line (oldest first). Returns the results oldest first. On errors,
+// the records that could be parsed are returned and `error` describes the
+// first error: lines that cannot be parsed are skipped, and a damaged array
+// is read up to the last complete record.
+std::vector<TestResult> ReadJSONHistory(std::string_view content,
+                                        std::string& error) {
+  std::vector<TestResult> ret;
+  size_t start = content.find_first_not_of(" \t\r\n");
+  if (start == std::string_view::npos) return ret;
+  if (content[start] == '{') {
+    for (size_t pos = start; pos < content.size();) {
+      size_t end = content.find('\n', pos);
+      if (end == std::string_view::npos) break; // interrupted append
+      std::string_view line = content.substr(pos, end - pos);
+      if (line.find_first_not_of(" \t\r") != std::string_view::npos) {
+        size_t size = ret.size();
+        HistorySAX sax(ret, 1);
+        try {
+          ParseJSON(content, pos, end, sax);
+        } catch (std::runtime_error& e) {
+          if (error.empty()) error = e.what();
+          ret.resize(size);
+        }
+      }
+      pos = end + 1;
+    }
+  } else {
+    HistorySAX sax(ret, 2);
+    try {
+      ParseJSON(content, 0, content.size(), sax);
+    } catch (std::runtime_error& e) {
+      error = e.what();
+      ret.resize(sax.Complete());
+    }
+    std::reverse(ret.begin(), ret.end());
+  }
+  return ret;
+}
+
+// CRC-32 (IEEE 802.3)
+struct CRCTable {
+  uint32_t table[256];
+  constexpr CRCTable() : table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        crc = crc & 1 ? 0xedb88320 ^ crc >> 1 : crc >> 1;
+      }
+      table[i] = crc;
+    }
+  }
+};
+constexpr CRCTable kCRCTable;
+
+// CRC32(b, CRC32(a)) == CRC32(a + b)
+uint32_t CRC32(std::string_view str, uint32_t crc = 0) {
+  crc = ~crc;
+  for (unsigned char ch : str) {
+    crc = kCRCTable.table[(crc ^ ch) & 0xff] ^ crc >> 8;
+  }
+  return ~crc;
+}
+
+uint32_t HeaderCRC(HistoryRecordHeader header, std::string_view file) {
+  header.header_crc = 0;
+  return CRC32(file, CRC32(std::string_view(
+      reinterpret_cast<const char*>(&header), sizeof(header))));
+}
+
+// Reads the header at `pos` of `content` if it is valid and its record fits
+bool ReadHeader(std::string_view content, uint64_t pos,
+                HistoryRecordHeader& header) {
+  if (content.size() - pos < sizeof(header)) return false;
+  memcpy(&header, content.data() + pos, sizeof(header));
+  uint64_t file_pos = pos + sizeof(header);
+  if ((uint64_t)header.file_size + header.payload_size >
+      content.size() - file_pos) {
+    return false;
+  }
+  return header.header_crc ==
+         HeaderCRC(header, content.substr(file_pos, header.file_size));
+}
+
+inline void PutU32(std::string& out, uint32_t x) {
+  out.append(reinterpret_cast<const char*>(&x), 4);
+}
+
+inline void PutVarint(std::string& out, uint64_t x) {
+  for (; x >= 0x80; x >>= 7) out += (char)(x | 0x80);
+  out += (char)x;
+}
+
+// Bits needed for the values [0, n)
+inline int BitWidth(size_t n) {
+  return n > 1 ? 64 - __builtin_clzll(n - 1) : 0;
+}
+
+// Bounds-checked reading of a payload
+class PayloadReader {
+  const char *p_, *end_;
+ public:
+  PayloadReader(std::string_view str)
+      : p_(str.data()), end_(p_ + str.size()) {}
+  size_t Remaining() const { return end_ - p_; }
+  bool Byte(uint8_t& x) {
+    if (p_ == end_) return false;
+    x = *p_++;
+    return true;
+  }
+  bool U32(uint32_t& x) {
+    if (end_ - p_ < 4) return false;
+    memcpy(&x, p_, 4);
+    p_ += 4;
+    return true;
+  }
+  bool Varint(uint64_t& x) {
+    x = 0;
+    for (int shift = 0; shift < 64 && p_ != end_; shift += 7) {
+      uint8_t byte = *p_++;
+      x |= (uint64_t)(byte & 0x7f) << shift;
+      if (byte < 0x80) return true;
+    }
+    return false;
+  }
+  bool Bytes(size_t size, std::string_view& out) {
+    if ((size_t)(end_ - p_) < size) return false;
+    out = std::string_view(p_, size);
+    p_ += size;
+    return true;
+  }
+  bool AtEnd() const { return p_ == end_; }
+};
+
+// A list of question ids is stored in the smallest of these codings, after a
+// tag byte:
+//   kVarintIds: each id as a varint
+//   kDeltaIds: the ids in increasing order, as varint differences from the
+//     previous one (the first from 0)
+//   kBitmapIds: the smallest id and the size of the bitmap as varints, then
+//     the bitmap of (id - smallest id); only if the ids are distinct
+// With kPermuted, the sorted ids are followed by the rank of each id of the
+// list among them, bit-packed with the width needed for the list size.
+enum IdCoding : uint8_t { kVarintIds, kDeltaIds, kBitmapIds };
+const uint8_t kPermuted = 0x80;
+
+void EncodeIds(const std::vector<uint32_t>& ids, std::string& out) {
+  size_t n = ids.size();
+  std::string best(1, kVarintIds);
+  for (auto& i : ids) PutVarint(best, i);
+  if (n < 2) {
+    out += best;
+    return;
+  }
+  std::vector<uint32_t> order(n);
+  for (size_t i = 0; i < n; i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [&](uint32_t x, uint32_t y) { return ids[x] < ids[y]; });
+  bool distinct = true;
+  for (size_t i = 1; i < n; i++) {
+    if (ids[order[i - 1]] == ids[order[i]]) distinct = false;
+  }
+  uint8_t permuted = 0;
+  std::string ranks;
+  if (!std::is_sorted(ids.begin(), ids.end())) {
+    permuted = kPermuted;
+    int width = BitWidth(n);
+    uint64_t buf = 0;
+    int bits = 0;
+    std::vector<uint32_t> rank(n);
+    for (size_t i = 0; i < n; i++) rank[order[i]] = i;
+    for (auto& i : rank) {
+      buf |= (uint64_t)i << bits;
+      for (bits += width; bits >= 8; bits -= 8, buf >>= 8) ranks += (char)buf;
+    }
+    if (bits) ranks += (char)buf;
+  }
+
+  std::string delta(1, kDeltaIds | permuted);
+  uint32_t prev = 0;
+  for (auto& i : order) {
+    PutVarint(delta, ids[i] - prev);
+    prev = ids[i];
+  }
+  delta += ranks;
+  if (delta.size() < best.size()) best.swap(delta);
+
+  uint32_t low = ids[order[0]], high = ids[order[n - 1]];
+  size_t bitmap_size = (high - low) / 8 + 1;
+  if (distinct && bitmap_size + ranks.size() + 12 < best.size()) {
+    std::string bitmap(1, kBitmapIds | permuted);
+    PutVarint(bitmap, low);
+    PutVarint(bitmap, bitmap_size);
+    size_t pos = bitmap.size();
+    bitmap.resize(pos + bitmap_size);
+    for (auto& i : ids) bitmap[pos + (i - low) / 8] |= 1 << (i - low) % 8;
+    bitmap += ranks;
+    if (bitmap.size() < best.size()) best.swap(bitmap);
+  }
+  out += best;
+}
+
+bool DecodeIds(PayloadReader& reader, size_t n, std::vector<uint32_t>& ids) {
+  uint8_t tag;
+  if (!reader.Byte(tag)) return false;
+  ids.clear();
+  // Every coding takes at least a bit per id
+  if (n / 8 > reader.Remaining()) return false;
+  ids.reserve(n);
+  uint64_t x;
+  switch (tag & ~kPermuted) {
+    case kVarintIds:
+      if (tag & kPermuted) return false;
+      for (size_t i = 0; i < n; i++) {
+        if (!reader.Varint(x) || x > UINT32_MAX) return false;
+        ids.push_back(x);
+      }
+      break;
+    case kDeltaIds: {
+      uint64_t id = 0;
+      for (size_t i = 0; i < n; i++) {
+        if (!reader.Varint(x) || x > UINT32_MAX) return false;
+        if ((id += x) > UINT32_MAX) return false;
+        ids.push_back(id);
+      }
+      break;
+    }
+    case kBitmapIds: {
+      uint64_t low, size;
+      std::string_view bitmap;
+      if (!reader.Varint(low) || !reader.Varint(size) ||
+          !reader.Bytes(size, bitmap)) {
+        return false;
+      }
+      for (size_t i = 0; i < size; i++) {
+        for (uint8_t byte = bitmap[i]; byte; byte &= byte - 1) {
+          uint64_t id = low + i * 8 + __builtin_ctz(byte);
+          if (id > UINT32_MAX || ids.size() == n) return false;
+          ids.push_back(id);
+        }
+      }
+      if (ids.size() != n) return false;
+      break;
+    }
+    default: return false;
+  }
+  if (tag & kPermuted) {
+    int width = BitWidth(n);
+    std::string_view packed;
+    if (!reader.Bytes(((uint64_t)n * width + 7) / 8, packed)) return false;
+    std::vector<uint32_t> sorted;
+    sorted.swap(ids);
+    uint64_t buf = 0;
+    int bits = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++) {
+      for (; bits < width; bits += 8) {
+        buf |= (uint64_t)(uint8_t)packed[pos++] << bits;
+      }
+      uint64_t rank = buf & ((1ULL << width) - 1);
+      buf >>= width;
+      bits -= width;
+      if (rank >= n) return false;
+      ids.push_back(sorted[rank]);
+    }
+  }
+  return true;
+}
+
+// Payload: ord (count ids), the number of unsure ids as a varint and the ids,
+// then the number of wrong answers as a varint, their ids, and the size (as a
+// varint) and bytes of each answer. Lists of ids are coded by EncodeIds.
+std::string EncodePayload(const TestResult& tr) {
+  std::string ret;
+  EncodeIds(tr.ord, ret);
+  PutVarint(ret, tr.unsure.size());
+  EncodeIds(std::vector<uint32_t>(tr.unsure.begin(), tr.unsure.end()), ret);
+  std::vector<uint32_t> wa_ids;
+  for (auto i : tr.wa) wa_ids.push_back(i.id);
+  PutVarint(ret, wa_ids.size());
+  EncodeIds(wa_ids, ret);
+  for (auto i : tr.wa) {
+    PutVarint(ret, i.ans.size());
+    ret += i.ans;
+  }
+  return ret;
+}
+
+bool DecodePayload(std::string_view payload, size_t count, TestResult& tr) {
+  PayloadReader reader(payload);
+  uint64_t num;
+  std::vector<uint32_t> ids;
+  if (!DecodeIds(reader, count, tr.ord)) return false;
+  tr.unsure.clear();
+  if (!reader.Varint(num) || !DecodeIds(reader, num, ids)) return false;
+  tr.unsure.reserve(ids.size());
+  for (auto& i : ids) tr.unsure.insert(i);
+  tr.wa.clear();
+  if (!reader.Varint(num) || !DecodeIds(reader, num, ids)) return false;
+  for (auto& i : ids) {
+    uint64_t size;
+    std::string_view ans;
+    if (!reader.Varint(size) || !reader.Bytes(size, ans)) return false;
+    tr.wa.push_back({i, ans});
+  }
+  return reader.AtEnd();
+}
+
+// Payload of records written before kCompactPayload: ord (count ids), then
+// the number of unsure ids and the ids in increasing order, then the number
+// of wrong answers and (id, size, answer) of each, all as 32-bit integers
+bool DecodeFixedPayload(std::string_view payload, size_t count,
+                        TestResult& tr) {
+  PayloadReader reader(payload);
+  uint32_t num, x;
+  tr.ord.resize(count);
+  for (auto& i : tr.ord) {
+    if (!reader.U32(i)) return false;
+  }
+  tr.unsure.clear();
+  if (!reader.U32(num)) return false;
+  for (uint32_t i = 0; i < num; i++) {
+    if (!reader.U32(x)) return false;
+    tr.unsure.insert(x);
+  }
+  tr.wa.clear();
+  if (!reader.U32(num)) return false;
+  for (uint32_t i = 0; i < num; i++) {
+    uint32_t id;
+    std::string_view ans;
+    if (!reader.U32(id) || !reader.U32(x) || !reader.Bytes(x, ans)) {
+      return false;
+    }
+    tr.wa.push_back({id, ans});
+  }
+  return reader.AtEnd();
+}
+
+std::string EncodeRecord(const TestResult& tr) {
+  std::string payload = EncodePayload(tr);
+  HistoryRecordHeader header = {};
+  header.finish = tr.finish;
+  header.elapsed = tr.elapsed;
+  header.score = tr.score;
+  header.fullmark = tr.fullmark;
+  header.count = tr.ord.size();
+  header.file_size = tr.file.size();
+  header.payload_size = payload.size();
+  header.flags = kCompactPayload;
+  header.payload_crc = CRC32(payload);
+  header.header_crc = HeaderCRC(header, tr.file.str());
+  std::string ret(reinterpret_cast<const char*>(&header), sizeof(header));
+  ret += tr.file;
+  ret += payload;
+  return ret;
+}
+
+bool WriteAll(int fd, std::string_view str) {
+  for (size_t pos = 0; pos < str.size();) {
+    ssize_t n = write(fd, str.data() + pos, str.size() - pos);
+    if (n < 0) return false;
+    pos += n;
+  }
+  return true;
+}
+
+// Whether `fd` is still the file at `filename`, which another process may
+// have replaced
+bool IsCurrent(int fd, const std::string& filename) {
+  struct stat fd_stat, path_stat;
+  return !fstat(fd, &fd_stat) && !stat(filename.c_str(), &path_stat) &&
+         fd_stat.st_dev == path_stat.st_dev &&
+         fd_stat.st_ino == path_stat.st_ino;
+}
+
+// Locks `fd` with flock `operation`, first opening `filename` with `flags` if
+// `fd` is not open. If the file was replaced before the lock was taken, it is
+// reopened, so that the lock is on the current file. Without lock support,
+// proceeds unlocked.
+bool LockCurrent(const std::string& filename, int flags, int operation,
+                 int& fd) {
+  while (true) {
+    if (fd < 0) fd = open(filename.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    if (flock(fd, operation) || IsCurrent(fd, filename)) return true;
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool ReadAll(int fd, char* buf, size_t size, uint64_t offset) {
+  for (size_t pos = 0; pos < size;) {
+    ssize_t n = pread(fd, buf + pos, size - pos, offset + pos);
+    if (n <= 0) return false;
+    pos += n;
+  }
+  return true;
+}
+
+// Parses YYYY, YYYY-MM or YYYY-MM-DD as the first second of that period in
+// local time, or the last second if `end` is set
+bool ParseDate(std::string_view str, bool end, time_t& out) {
+  int fields[3] = {0, 1, 1};
+  size_t num = 0;
+  const char *p = str.data(), *last = p + str.size();
+  while (num < 3) {
+    auto res = std::from_chars(p, last, fields[num]);
+    if (res.ec != std::errc() || res.ptr == p) return false;
+    p = res.ptr;
+    num++;
+    if (p == last) break;
+    if (*p++ != '-') return false;
+  }
+  if (p != last || fields[1] < 1 || fields[1] > 12 || fields[2] < 1 ||
+      fields[2] > 31) {
+    return false;
+  }
+  auto MakeTime = [&fields](struct tm& tm) {
+    tm = {};
+    tm.tm_year = fields[0] - 1900;
+    tm.tm_mon = fields[1] - 1;
+    tm.tm_mday = fields[2];
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+  };
+  struct tm tm;
+  out = MakeTime(tm);
+  // Reject dates that mktime normalizes, such as 2024-02-31
+  if (out == -1 || tm.tm_mon != fields[1] - 1 || tm.tm_mday != fields[2]) {
+    return false;
+  }
+  if (end) {
+    fields[num - 1]++;
+    out = MakeTime(tm);
+    if (out == -1) return false;
+    out--;
+  }
+  return true;
+}
+
+} // namespace
+
+bool ParseHistoryQuery(const std::string& str, HistoryQuery& query,
+                       std::string& error) {
+  query = HistoryQuery();
+  for (size_t pos = 0; pos < str.size();) {
+    size_t end = str.find(' ', pos);
+    if (end == std::string::npos) end = str.size();
+    std::string_view term = std::string_view(str).substr(pos, end - pos);
+    pos = end + 1;
+    if (term.empty()) continue;
+    if (term.substr(0, 5) == "from:" || term.substr(0, 3) == "to:") {
+      bool is_to = term[0] == 't';
+      std::string_view date = term.substr(term.find(':') + 1);
+      if (!ParseDate(date, is_to, is_to ? query.to : query.from)) {
+        error = "Invalid date: " + std::string(date);
+        return false;
+      }
+    } else if (term.substr(0, 6) == "score:") {
+      std::string_view range = term.substr(6);
+      size_t dash = range.find('-');
+      std::string_view bounds[2] = {range.substr(0, dash), ""};
+      if (dash != std::string_view::npos) bounds[1] = range.substr(dash + 1);
+      int* out[2] = {&query.min_score, &query.max_score};
+      bool valid = !bounds[0].empty() || !bounds[1].empty();
+      for (int i = 0; i < 2 && valid; i++) {
+        std::string_view bound = bounds[i];
+        if (bound.empty()) continue;
+        auto res = std::from_chars(bound.data(), bound.data() + bound.size(),
+                                   *out[i]);
+        valid = res.ec == std::errc() && res.ptr == bound.data() + bound.size();
+      }
+      if (dash == std::string_view::npos) query.max_score = query.min_score;
+      if (!valid || query.min_score > query.max_score) {
+        error = "Invalid score range: " + std::string(range);
+        return false;
+      }
+    } else {
+      query.files.emplace_back(term);
+    }
+  }
+  if (query.from > query.to) {
+    error = "Invalid date range: from: is later than to:";
+    return false;
+  }
+  return true;
+}
+
+std::string HistoryEntry::GetMenuText(int tot_width) const {
+  const std::string& file = this->file;
+  int name_width = tot_width - kHistoryHeader.size();
+  size_t num = PrefixFit(file, name_width);
+  if (num < file.size()) {
+    while (num && 0x80 <= (unsigned char)file[num] &&
+           (unsigned char)file[num] < 0xc0) {
+      --num;
+    }
+  }
+  std::string display_file = file.substr(0, num);
+  size_t width = StringWidth(display_file);
+  char buf[50], datebuf[22];
+  strftime(datebuf, sizeof(datebuf), "%Y-%m-%d %H:%M:%S", localtime(&finish));
+  snprintf(buf, sizeof(buf), "%5d%11d%12.3lf%20s", score, (int)count,
+           elapsed, datebuf);
+  return display_file + std::string(name_width - width, ' ') + buf;
+}
+
+HistoryStore::~HistoryStore() {
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (writer_.joinable()) writer_.join(); // writes the remaining records
+  Close_();
+}
+
+void HistoryStore::Close_() {
+  if (fd_ >= 0) close(fd_);
+  if (read_fd_ >= 0) close(read_fd_);
+  fd_ = read_fd_ = -1;
+}
+
+void HistoryStore::Add_(const TestResult& tr, uint64_t payload_offset,
+                        uint32_t payload_size, uint32_t payload_crc) {
+  entries_.push_back({tr.file, tr.finish, tr.elapsed, tr.score, tr.fullmark,
+                      (uint32_t)tr.ord.size(), payload_size, payload_crc,
+                      kCompactPayload, payload_offset});
+  if (!payload_offset) recent_.emplace(entries_.size() - 1, tr);
+}
+
+// Indexes the records after end_. With an exclusive lock, an incomplete tail
+// is truncated; otherwise it may be an append of another process.
+bool HistoryStore::Index_(bool& damaged, bool exclusive) {
+  damaged = false;
+  MappedFile file;
+  if (!file.Open(filename_, end_ == 0)) return false;
+  std::string_view content = file.View();
+  if (content.size() < sizeof(kHistoryMagic) ||
+      memcmp(content.data(), kHistoryMagic, sizeof(kHistoryMagic))) {
+    return false;
+  }
+  decltype(own_) own;
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    own = own_;
+  }
+  auto is_own = [&](uint64_t pos) {
+    for (auto& i : own) {
+      if (i.first <= pos && pos < i.second) return true;
+    }
+    return false;
+  };
+  size_t first = entries_.size();
+  std::vector<uint64_t> starts; // of the records added to entries_
+  uint64_t pos = std::max<uint64_t>(end_, sizeof(kHistoryMagic));
+  while (pos < content.size()) {
+    HistoryRecordHeader header;
+    if (!ReadHeader(content, pos, header)) {
+      // Skip to the next valid record; if there is none, this is the
+      // incomplete tail of an interrupted append
+      uint64_t next = pos + 1;
+      while (next < content.size() && !ReadHeader(content, next, header)) {
+        next++;
+      }
+      if (next == content.size()) break;
+      damaged = true;
+      pos = next;
+    }
+    uint64_t payload_pos = pos + sizeof(header) + header.file_size;
+    if (!is_own(pos)) {
+      entries_.push_back({content.substr(pos + sizeof(header),
+                                         header.file_size),
+                          header.finish, header.elapsed, header.score,
+                          header.fullmark, header.count, header.payload_size,
+                          header.payload_crc, header.flags, payload_pos});
+      starts.push_back(pos);
+    }
+    pos = payload_pos + header.payload_size;
+  }
+  // The headers of an interrupted append may have reached the disk without
+  // their payloads; payloads of older records are checked when loaded
+  while (entries_.size() > first) {
+    const HistoryEntry& entry = entries_.back();
+    if (CRC32(content.substr(entry.payload_offset, entry.payload_size)) ==
+        entry.payload_crc) {
+      break;
+    }
+    pos = starts.back();
+    starts.pop_back();
+    entries_.pop_back();
+  }
+  end_ = pos;
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    own_.erase(std::remove_if(own_.begin(), own_.end(),
+                              [&](auto& i) { return i.second <= end_; }),
+               own_.end());
+  }
+  // fd_ is read-only if the file could not be opened for writing
+  bool writable = fd_ >= 0 && (fcntl(fd_, F_GETFL) & O_ACCMODE) != O_RDONLY;
+  if (exclusive && end_ < content.size() && writable &&
+      ftruncate(fd_, end_)) {
+    // Left to the next writer: records appended after the tail are recovered
+    // when the file is opened again. read_fd_ stays open for loading.
+  }
+  return true;
+}
+
+// Writes `results` to a new file that atomically replaces the history. If
+// `backup` is given, the old file is kept under that name.
+bool HistoryStore::Convert_(const std::vector<TestResult>& results,
+                            const std::string& backup) {
+  std::string tmp = filename_ + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  std::string buf(kHistoryMagic, sizeof(kHistoryMagic));
+  bool ok = true;
+  for (auto& i : results) {
+    buf += EncodeRecord(i);
+    if (buf.size() >= 1 << 16) {
+      ok = ok && WriteAll(fd, buf);
+      buf.clear();
+    }
+  }
+  // The data must be on disk before the rename makes it the history
+  ok = ok && WriteAll(fd, buf) && !fsync(fd);
+  if (close(fd) || !ok) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  if (backup.size()) {
+    std::remove(backup.c_str());
+    if (link(filename_.c_str(), backup.c_str())) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp.c_str(), filename_.c_str())) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  // Persist the rename
+  std::string dir = std::filesystem::path(filename_).parent_path();
+  int dir_fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  Close_();
+  entries_.clear();
+  index_ = QueryIndex_();
+  recent_.clear();
+  end_ = 0;
+  if (!LockCurrent(filename_, O_RDWR | O_APPEND, LOCK_EX, fd_)) return false;
+  read_fd_ = open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+  bool damaged;
+  ok = read_fd_ >= 0 && Index_(damaged, true);
+  if (fd_ >= 0) flock(fd_, LOCK_UN);
+  return ok;
+}
+
+void HistoryStore::Salvage_(const std::vector<TestResult>& results,
+                            const std::string& problem) {
+  std::string backup = filename_ + ".bak";
+  note_ = "History file damaged (" + problem + "); " +
+          std::to_string(results.size()) + " results recovered";
+  if (Convert_(results, backup)) {
+    note_ += ", damaged file kept as " + backup;
+    return;
+  }
+  // Keep everything in memory, and leave the file as is
+  note_ += " but not saved";
+  Close_();
+  entries_.clear();
+  index_ = QueryIndex_();
+  recent_.clear();
+  for (auto& i : results) Add_(i, 0, 0, 0);
+}
+
+void HistoryStore::Open(const std::string& filename) {
+  Flush();
+  Close_();
+  filename_ = filename;
+  entries_.clear();
+  index_ = QueryIndex_();
+  recent_.clear();
+  end_ = 0;
+  note_.clear();
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    own_.clear();
+    unwritten_.clear();
+  }
+  // Held until the file is indexed or replaced; closing fd_ releases it
+  if (!LockCurrent(filename_, O_RDWR | O_APPEND | O_CREAT, LOCK_EX, fd_) &&
+      !LockCurrent(filename_, O_RDONLY, LOCK_EX, fd_)) {
+    return;
+  }
+  read_fd_ = open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+  bool damaged;
+  if (Index_(damaged, true)) {
+    if (!damaged) {
+      if (fd_ >= 0) flock(fd_, LOCK_UN);
+      return;
+    }
+    std::vector<TestResult> results;
+    for (size_t i = entries_.size(); i--;) {
+      TestResult tr;
+      if (Load(i, tr)) results.push_back(std::move(tr));
+    }
+    Salvage_(results, "damaged records skipped");
+    return;
+  }
+
+  MappedFile file;
+  if (!file.Open(filename) || !file.size()) { // new history
+    if (fd_ >= 0) flock(fd_, LOCK_UN);
+    return;
+  }
+  // JSON written by older versions
+  std::string error;
+  std::vector<TestResult> results = ReadJSONHistory(file.View(), error);
+  file.Close();
+  if (error.size()) {
+    Salvage_(results, error);
+    return;
+  }
+  std::string backup = filename_ + ".json.bak";
+  if (Convert_(results, backup)) {
+    note_ = "History converted to the new format; old file kept as " + backup;
+    return;
+  }
+  // Keep everything in memory, and leave the file as is
+  Close_();
+  entries_.clear();
+  index_ = QueryIndex_();
+  for (auto& i : results) Add_(i, 0, 0, 0);
+}
+
+void HistoryStore::UpdateIndex_() {
+  size_t old = index_.size, num = entries_.size();
+  if (old == num) return;
+  for (size_t i = old; i < num; i++) {
+    index_.by_file[entries_[i].file].push_back(i);
+  }
+  // New entries are sorted and merged, stably to keep equal keys in order of
+  // position; they usually go to the end already
+  auto extend = [&](std::vector<uint32_t>& index, auto key) {
+    auto less = [&](uint32_t x, uint32_t y) { return key(x) < key(y); };
+    size_t mid = index.size();
+    for (size_t i = old; i < num; i++) index.push_back(i);
+    if (!std::is_sorted(index.begin() + mid, index.end(), less)) {
+      std::stable_sort(index.begin() + mid, index.end(), less);
+    }
+    if (mid && less(index[mid], index[mid - 1])) {
+      std::inplace_merge(index.begin(), index.begin() + mid, index.end(),
+                         less);
+    }
+  };
+  extend(index_.by_finish, [&](uint32_t i) { return entries_[i].finish; });
+  extend(index_.by_score, [&](uint32_t i) { return entries_[i].score; });
+  index_.size = num;
+}
+
+std::vector<size_t> HistoryStore::Find(const HistoryQuery& query) {
+  size_t num = entries_.size();
+  HistoryQuery all;
+  if (query.files.empty() && query.from == all.from && query.to == all.to &&
+      query.min_score == all.min_score && query.max_score == all.max_score) {
+    std::vector<size_t> ret(num);
+    for (size_t i = 0; i < num; i++) ret[i] = i;
+    return ret; // no need for the indexes
+  }
+  UpdateIndex_();
+  // File paths are matched once per distinct file
+  std::unordered_set<InternedString> files;
+  size_t file_count = 0;
+  if (query.files.size()) {
+    for (auto& i : index_.by_file) {
+      bool match = true;
+      for (auto& j : query.files) {
+        if (i.first.str().find(j) == std::string::npos) match = false;
+      }
+      if (match) {
+        files.insert(i.first);
+        file_count += i.second.size();
+      }
+    }
+  }
+
+  // Candidates from the narrowest index
+  auto finish_begin = std::lower_bound(
+      index_.by_finish.begin(), index_.by_finish.end(), query.from,
+      [&](uint32_t i, time_t x) { return entries_[i].finish < x; });
+  auto finish_end = std::upper_bound(
+      finish_begin, index_.by_finish.end(), query.to,
+      [&](time_t x, uint32_t i) { return x < entries_[i].finish; });
+  auto score_begin = std::lower_bound(
+      index_.by_score.begin(), index_.by_score.end(), query.min_score,
+      [&](uint32_t i, int x) { return entries_[i].score < x; });
+  auto score_end = std::upper_bound(
+      score_begin, index_.by_score.end(), query.max_score,
+      [&](int x, uint32_t i) { return x < entries_[i].score; });
+  size_t finish_count = finish_end - finish_begin,
+         score_count = score_end - score_begin;
+  size_t best = std::min(finish_count, score_count);
+  if (query.files.size()) best = std::min(best, file_count);
+
+  bool by_file = query.files.size() && best == file_count;
+  auto matches = [&](size_t pos) {
+    const HistoryEntry& entry = entries_[pos];
+    return entry.finish >= query.from && entry.finish <= query.to &&
+           entry.score >= query.min_score && entry.score <= query.max_score &&
+           (by_file || query.files.empty() || files.count(entry.file));
+  };
+  std::vector<size_t> ret;
+  auto add = [&](size_t pos) {
+    if (matches(pos)) ret.push_back(num - 1 - pos);
+  };
+  if (best == num) { // nothing to narrow down
+    for (size_t pos = num; pos--;) add(pos);
+    return ret;
+  }
+  std::vector<uint32_t> candidates;
+  candidates.reserve(best);
+  if (by_file) {
+    for (auto& i : files) {
+      auto& list = index_.by_file[i];
+      candidates.insert(candidates.end(), list.begin(), list.end());
+    }
+  } else if (best == finish_count) {
+    candidates.assign(finish_begin, finish_end);
+  } else {
+    candidates.assign(score_begin, score_end);
+  }
+  if (best > num / 32) {
+    // Marking the candidates costs less than sorting them
+    std::vector<bool> marked(num);
+    for (auto& i : candidates) marked[i] = true;
+    for (size_t pos = num; pos--;) {
+      if (marked[pos]) add(pos);
+    }
+    return ret;
+  }
+  std::sort(candidates.begin(), candidates.end());
+  for (auto it = candidates.rbegin(); it != candidates.rend(); ++it) add(*it);
+  return ret;
+}
+
+bool HistoryStore::Load(size_t i, TestResult& result) const {
+  size_t idx = entries_.size() - 1 - i;
+  auto it = recent_.find(idx);
+  if (it != recent_.end()) {
+    result = it->second;
+    return true;
+  }
+  const HistoryEntry& entry = entries_[idx];
+  std::string payload(entry.payload_size, '\0');
+  if (!ReadAll(read_fd_, payload.data(), payload.size(),
+               entry.payload_offset) ||
+      CRC32(payload) != entry.payload_crc) {
+    return false;
+  }
+  result.file = entry.file;
+  result.finish = entry.finish;
+  result.elapsed = entry.elapsed;
+  result.score = entry.score;
+  result.fullmark = entry.fullmark;
+  if (entry.flags & kCompactPayload) {
+    return DecodePayload(payload, entry.count, result);
+  }
+  return DecodeFixedPayload(payload, entry.count, result);
+}
+
+void HistoryStore::Refresh() {
+  if (read_fd_ < 0) return;
+  if (!IsCurrent(read_fd_, filename_)) {
+    // Replaced by another process: the results that could not be written are
+    // only in memory, so append them to the new file
+    Flush();
+    std::vector<TestResult> unwritten;
+    {
+      std::lock_guard<std::mutex> lck(mutex_);
+      for (size_t i : unwritten_) unwritten.push_back(std::move(recent_[i]));
+    }
+    Open(filename_);
+    for (auto& i : unwritten) Append(i);
+    return;
+  }
+  struct stat st;
+  if (fstat(read_fd_, &st) || (uint64_t)st.st_size == end_) return;
+  bool locked = !flock(read_fd_, LOCK_SH);
+  bool damaged;
+  Index_(damaged, false);
+  if (locked) flock(read_fd_, LOCK_UN);
+}
+
+void HistoryStore::Append(const TestResult& tr) {
+  Refresh();
+  Add_(tr, 0, 0, 0);
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    queue_ += EncodeRecord(tr);
+    queued_.push_back(entries_.size() - 1);
+  }
+  if (!writer_.joinable()) {
+    writer_ = std::thread(&HistoryStore::Write_, this);
+  }
+  cv_.notify_all();
+}
+
+void HistoryStore::Flush() {
+  std::unique_lock<std::mutex> lck(mutex_);
+  cv_.wait(lck, [this]() { return queue_.empty() && !busy_; });
+}
+
+std::string HistoryStore::Error() const {
+  std::lock_guard<std::mutex> lck(mutex_);
+  return error_;
+}
+
+void HistoryStore::Write_() {
+  std::unique_lock<std::mutex> lck(mutex_);
+  while (true) {
+    cv_.wait(lck, [this]() { return stop_ || queue_.size(); });
+    if (queue_.empty()) return; // stopped
+    std::string records;
+    records.swap(queue_);
+    std::vector<size_t> indexes;
+    indexes.swap(queued_);
+    busy_ = true;
+    lck.unlock();
+    bool written;
+    std::string error = WriteRecords_(records, written);
+    lck.lock();
+    busy_ = false;
+    if (error.size()) error_ = error;
+    if (!written) {
+      unwritten_.insert(unwritten_.end(), indexes.begin(), indexes.end());
+    }
+    cv_.notify_all();
+  }
+}
+
+std::string HistoryStore::WriteRecords_(std::string& records, bool& written) {
+  written = false;
+  if (fd_ < 0 || broken_) return "the history file is not writable";
+  if (!LockCurrent(filename_, O_RDWR | O_APPEND | O_CREAT, LOCK_EX, fd_)) {
+    return strerror(errno);
+  }
+  // Other processes may have appended; only the lock holder writes
+  std::string error;
+  struct stat st;
+  if (fstat(fd_, &st)) {
+    error = strerror(errno);
+  } else {
+    uint64_t start = st.st_size;
+    if (!start) records.insert(0, kHistoryMagic, sizeof(kHistoryMagic));
+    if (WriteAll(fd_, records)) {
+      std::lock_guard<std::mutex> lck(mutex_);
+      own_.emplace_back(start, start + records.size());
+      written = true;
+    } else {
+      error = strerror(errno);
+      // Remove the partial write, so that later records can be appended
+      if (ftruncate(fd_, start)) broken_ = true;
+    }
+  }
+  flock(fd_, LOCK_UN);
+  // One sync for all the records written together, without holding the lock
+  if (written && fdatasync(fd_)) {
+    error = std::string("sync failed: ") + strerror(errno);
+  }
+  return error;
+}
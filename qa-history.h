@@ -0,0 +1,164 @@
+#ifndef QA_HISTORY_H_
+#define QA_HISTORY_H_
+
+#include <map>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "qa-file.h"
+
+// History file.
+// A binary journal: kHistoryMagic, then one record per test result, appended
+// when the test finishes. Native byte order, as it is local to the user.
+// Record layout:
+//   HistoryRecordHeader
+//   file (file_size bytes)
+//   payload (payload_size bytes): ord, unsure and wa of the result, with the
+//     ids in whichever of several codings is the smallest for each list
+// The headers and file names form the index that is read at startup; the
+// payload is decoded only when a result is opened. JSON history files written
+// by older versions are converted on open, keeping the old file as
+// `<filename>.json.bak`.
+// Each header carries CRC-32s of itself (with the file name) and of the
+// payload. A torn last record is truncated on open; records damaged elsewhere
+// are skipped by searching for the next valid header, and the valid ones are
+// written to a new file, keeping the damaged one as `<filename>.bak`.
+// Several processes may share the file. Appends, truncation and replacement
+// hold an exclusive flock on it, and indexing a shared one; each process
+// indexes the records appended by the others when it refreshes.
+
+extern const char kHistoryMagic[8];
+
+struct HistoryRecordHeader {
+  int64_t finish;
+  double elapsed;
+  int32_t score, fullmark;
+  uint32_t count; // number of questions
+  uint32_t file_size, payload_size;
+  uint32_t payload_crc;
+  uint32_t header_crc; // of the header with this field 0, and the file name
+  uint32_t flags;
+};
+
+// Flag of records whose payload is coded compactly, with varints and
+// per-list id codings; older records use fixed 32-bit integers
+const uint32_t kCompactPayload = 1;
+
+extern const std::string kHistoryHeader;
+
+// Index entry of a result
+struct HistoryEntry {
+  InternedString file;
+  time_t finish;
+  double elapsed;
+  int score, fullmark;
+  uint32_t count, payload_size, payload_crc, flags;
+  uint64_t payload_offset;
+  std::string GetMenuText(int width) const;
+};
+
+// Filter of history entries. An entry matches if its file path contains every
+// string of `files`, and its finish time and score are within the ranges.
+struct HistoryQuery {
+  std::vector<std::string> files;
+  time_t from = std::numeric_limits<time_t>::min();
+  time_t to = std::numeric_limits<time_t>::max();
+  int min_score = std::numeric_limits<int>::min();
+  int max_score = std::numeric_limits<int>::max();
+};
+
+// Parses a filter of space-separated terms:
+//   from:DATE, to:DATE   finished within DATE (YYYY, YYYY-MM or YYYY-MM-DD in
+//                        local time), inclusive
+//   score:A-B            score in [A, B]; either bound may be omitted
+//   anything else        part of the file path
+// Returns false and sets `error` if the filter is invalid.
+bool ParseHistoryQuery(const std::string& str, HistoryQuery& query,
+                       std::string& error);
+
+// Records are written by a background thread, so that a slow disk does not
+// block the UI. Records queued while a write is in progress are written
+// together with a single write and a single fdatasync.
+class HistoryStore {
+  std::string filename_;
+  int fd_ = -1; // for appending
+  int read_fd_ = -1; // for loading payloads
+  uint64_t end_ = 0; // end of the last indexed record
+  std::vector<HistoryEntry> entries_; // oldest first
+  // Results not read from the file (appended in this session, or kept in
+  // memory because the file could not be converted), by position in entries_
+  std::map<size_t, TestResult> recent_;
+  // Writer thread; fd_ belongs to it while it runs
+  std::thread writer_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::string queue_; // encoded records to write
+  // Positions in entries_ of the records in queue_, and of those whose write
+  // failed, which are only in recent_
+  std::vector<size_t> queued_, unwritten_;
+  // File ranges written by this process and not indexed yet, which are
+  // already in recent_
+  std::vector<std::pair<uint64_t, uint64_t>> own_;
+  bool busy_ = false, stop_ = false, broken_ = false;
+  std::string error_;
+  std::string note_; // what was recovered on open
+  // Indexes for Find, over entries_[0, size); built when queried
+  struct QueryIndex_ {
+    size_t size = 0;
+    std::unordered_map<InternedString, std::vector<uint32_t>> by_file;
+    std::vector<uint32_t> by_finish, by_score; // positions in entries_
+  } index_;
+  void UpdateIndex_();
+  void Close_();
+  bool Index_(bool& damaged, bool exclusive);
+  bool Convert_(const std::vector<TestResult>& results,
+                const std::string& backup = "");
+  void Salvage_(const std::vector<TestResult>& results,
+                const std::string& problem);
+  void Add_(const TestResult&, uint64_t payload_offset, uint32_t payload_size,
+            uint32_t payload_crc);
+  void Write_();
+  std::string WriteRecords_(std::string& records, bool& written);
+ public:
+  HistoryStore() = default;
+  ~HistoryStore();
+  HistoryStore(const HistoryStore&) = delete;
+  HistoryStore& operator=(const HistoryStore&) = delete;
+  // Reads the index, truncating an incomplete last record. A damaged file is
+  // replaced by the results that could be recovered; see Note().
+  void Open(const std::string& filename);
+  // Indexes the records appended by other processes since the last refresh.
+  // Cheap if there are none.
+  void Refresh();
+  // Describes the recovery or conversion done by Open, or empty if there was
+  // none
+  const std::string& Note() const { return note_; }
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  // Newest first
+  const HistoryEntry& operator[](size_t i) const {
+    return entries_[entries_.size() - 1 - i];
+  }
+  // Indices (for operator[] and Load) of the entries matching `query`, newest
+  // first. Entries are looked up through the index of the most selective
+  // condition, so the cost depends little on the size of the history.
+  std::vector<size_t> Find(const HistoryQuery& query);
+  // Decodes the whole result of entry `i` (newest first)
+  bool Load(size_t i, TestResult& result) const;
+  // Queues one record to be appended, after refreshing; the cost does not
+  // depend on the size of the history. The result stays available in memory
+  // even if writing fails.
+  void Append(const TestResult&);
+  // Waits until all queued records are written
+  void Flush();
+  // The last write error, or empty if all writes succeeded
+  std::string Error() const;
+};
+
+#endif // QA_HISTORY_H_
@@ -80,6 +80,57 @@ int MenuScreen::GetValue() const {
   return menu_.GetValue();
 }
 
+ListScreen::ListScreen(size_t size, VirtualList::RowFunc row,
+                       HeaderFunc header)
+    : list_(size, std::move(row), 2, 1, 1, COLS - 2),
+      header_(std::move(header)),
+      leave_(false) {
+  Resize_();
+}
+
+void ListScreen::Resize_() {
+  curs_set(0); // hidden again after a prompt
+  clear();
+  mvaddstr(LINES - 2, 1, message_.c_str());
+  RefreshTitle_();
+  WINDOW* win = derwin(stdscr, LINES - 4, COLS - 2, 2, 1);
+  mvwaddstr(win, 0, 0, header_(COLS - 2).c_str());
+  int y = getcury(win);
+  delwin(win);
+  wnoutrefresh(stdscr);
+  list_.SetWindow(y + 3, 1, std::max(LINES - 5 - y, 1), COLS - 2);
+}
+
+void ListScreen::SetMessage(const std::string& message) {
+  message_ = message;
+  Resize_();
+}
+
+void ListScreen::SetSize(size_t size) {
+  list_.SetSize(size);
+  Resize_(); // the header may depend on the rows
+}
+
+int ListScreen::GetValue() const {
+  if (leave_) return -1;
+  return list_.GetValue();
+}
+
+bool ListScreen::ProcessKey(int ch) {
+  leave_ = false;
+  if (ch == '\n') return list_.GetValue() != -1; // nothing to select
+  if (ch == 27) {
+    leave_ = true;
+    return true;
+  }
+  if (ch == KEY_RESIZE) {
+    Resize_();
+  } else {
+    list_.ProcessKey(ch);
+  }
+  return false;
+}
+
 void PromptScreen::Resize_() {
   clear();
   RefreshTitle_();
@@ -120,6 +171,10 @@ void PromptScreen::SetCursor() {
   text_.Refresh();
 }
 
+void PromptScreen::SetValue(const std::string& str) {
+  text_.SetText(str);
+}
+
 std::string PromptScreen::GetValue() const {
   return text_.GetValue();
 }
@@ -85,7 +85,26 @@ class MenuScreen : public ScreenWithTitle {
   }
 };
 
-// TODO: Add input buffer for UTF-8
+// Like MenuScreen, for long lists: rows and header are formatted for the
+// current width when needed, through `row(index, width)` and `header(width)`
+class ListScreen : public ScreenWithTitle {
+ public:
+  using HeaderFunc = std::function<std::string(int)>;
+ private:
+  VirtualList list_;
+  HeaderFunc header_;
+  std::string message_;
+  bool leave_;
+  void Resize_();
+ public:
+  ListScreen(size_t size, VirtualList::RowFunc row, HeaderFunc header);
+  void SetMessage(const std::string&);
+  // The rows have changed
+  void SetSize(size_t size);
+  int GetValue() const;
+  bool ProcessKey(int);
+};
+
 class PromptScreen : public ScreenWithTitle {
   Textbox text_;
   std::string header_;
@@ -95,6 +114,7 @@ class PromptScreen : public ScreenWithTitle {
   PromptScreen(const std::string& header = "");
   void SetMessage(const std::string&);
   void SetCursor();
+  void SetValue(const std::string&);
   std::string GetValue() const;
   bool ProcessKey(int);
 };
@@ -0,0 +1,21 @@
+#ifndef STRING_ARENA_H_
+#define STRING_ARENA_H_
+
+#include <memory>
+
+// One block of memory for strings, allocated at once with a fixed size. The
+// strings never move, and the block is released with a single free. The
+// memory is not initialized, so untouched pages of a large arena cost nothing.
+class StringArena {
+  std::unique_ptr<char[]> data_;
+  size_t size_;
+ public:
+  StringArena() : size_(0) {}
+  explicit StringArena(size_t size)
+      : data_(size ? new char[size] : nullptr), size_(size) {}
+  char* data() { return data_.get(); }
+  const char* data() const { return data_.get(); }
+  size_t size() const { return size_; }
+};
+
+#endif // STRING_ARENA_H_
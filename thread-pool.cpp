@@ -0,0 +1,46 @@
+#include "thread-pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads) : stop_(false) {
+  if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t i = 1; i < threads; i++) {
+    workers_.emplace_back(&ThreadPool::Work_, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& i : workers_) i.join();
+}
+
+void ThreadPool::Work_() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lck(mutex_);
+      cv_.wait(lck, [this]() { return stop_ || tasks_.size(); });
+      if (tasks_.empty()) return; // stopped
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lck(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+ThreadPool& DefaultThreadPool() {
+  static ThreadPool pool;
+  return pool;
+}
@@ -0,0 +1,61 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+// Fixed-size pool of worker threads.
+class ThreadPool {
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_;
+  void Work_();
+ public:
+  // The calling thread takes part in ParallelFor, so `threads` - 1 workers are
+  // started. 0 means one thread per core.
+  explicit ThreadPool(size_t threads = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  size_t Size() const { return workers_.size() + 1; }
+  void Submit(std::function<void()>);
+  // Calls func(i) for every i in [0, num) and waits for all of them. Safe to
+  // nest: the calling thread runs the calls no worker has picked up.
+  template <class Func>
+  void ParallelFor(size_t num, Func&& func) {
+    struct State {
+      std::atomic<size_t> next{0};
+      std::mutex mutex;
+      std::condition_variable cv;
+      size_t done = 0;
+    };
+    auto state = std::make_shared<State>();
+    // A helper starting after all calls are taken returns without touching
+    // `func`, so it may outlive this function.
+    auto Run = [state, num, &func]() {
+      size_t cnt = 0;
+      for (size_t i; (i = state->next.fetch_add(1)) < num; cnt++) func(i);
+      if (!cnt) return;
+      std::lock_guard<std::mutex> lck(state->mutex);
+      if ((state->done += cnt) == num) state->cv.notify_all();
+    };
+    for (size_t i = 1; i < std::min(num, Size()); i++) Submit(Run);
+    Run();
+    std::unique_lock<std::mutex> lck(state->mutex);
+    state->cv.wait(lck, [&]() { return state->done == num; });
+  }
+};
+
+// Shared pool with one thread per core
+ThreadPool& DefaultThreadPool();
+
+#endif // THREAD_POOL_H_
@@ -0,0 +1,34 @@
+#ifndef UTF8_H_
+#define UTF8_H_
+
+#include <string>
+#include <cstdint>
+#include <string_view>
+
+// UTF-8 handling that does not depend on the process locale and never throws.
+
+// Returned by DecodeUTF8 for a malformed sequence (overlong forms, surrogates
+// and code points above U+10FFFF included)
+const uint32_t kInvalidCodePoint = 0xffffffff;
+
+// Decodes the code point at `p` (which must be before `end`) and advances `p`
+// past it. A malformed sequence advances `p` by one byte only.
+uint32_t DecodeUTF8(const char*& p, const char* end);
+
+void AppendUTF8(uint32_t code_point, std::string& out);
+
+// Length of the ASCII prefix of [p, end)
+size_t ASCIIPrefix(const char* p, const char* end);
+
+// Simple (one-to-one) uppercase mapping, for the scripts that have case.
+// Code points without a mapping are returned as is.
+uint32_t FoldCase(uint32_t code_point);
+
+inline char FoldCaseASCII(char ch) {
+  return 'a' <= ch && ch <= 'z' ? ch - ('a' - 'A') : ch;
+}
+
+// Appends `str` with the case folded; malformed bytes are copied as is
+void FoldCaseUTF8(std::string_view str, std::string& out);
+
+#endif // UTF8_H_